@@ -50,26 +50,91 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include "revoco.h"
 
 #define streq(a,b)	(strcmp((a), (b)) == 0)
 #define strneq(a,b,c)	(strncmp((a), (b), (c)) == 0)
 
 #define LOGITECH		0x046d
-#define MX_REVOLUTION	0xc51a	// version RR41.01_B0025
-#define MX_REVOLUTION2	0xc525	// version RQR02.00_B0020
-#define MX_REVOLUTION3	0xc526	// don't know which version this is
-#define MX_REVOLUTION4	0xc52b	// Unifying Receiver (added 2015-05-30)
-#define MX_REVOLUTION5	0xb007	// ??? R0019 (added 2015-05-30)
-#define MX_5500			0xc71c	// keyboard/mouse combo - experimental
 
-static int first_byte;
+/* what a receiver understands */
+#define C_WHEEL			0x01	// wheel mode, register 0x56 and 0x08
+#define C_BATTERY		0x02	// register 0x0d
+#define C_RECONNECT		0x04	// register 0xb2
+#define C_ALL			0x07
+
+/* and how it differs */
+#define Q_UNIFYING		0x01	// up to six paired devices, long register 0xb5 lists them
+#define Q_EXPERIMENTAL	0x02
+
+/*
+ * M(name, product, hidpp, index, commands, quirks, what)
+ * hidpp is the newest HID++ its devices may speak, index the first byte
+ * of their frames unless --index says otherwise.
+ */
+#define MODELS(M) \
+	M(MX_REVOLUTION,  0xc51a, 1, 1, C_ALL, 0, "version RR41.01_B0025") \
+	M(MX_REVOLUTION2, 0xc525, 1, 1, C_ALL, 0, "version RQR02.00_B0020") \
+	M(MX_REVOLUTION3, 0xc526, 1, 1, C_ALL, 0, "don't know which version this is") \
+	M(MX_REVOLUTION4, 0xc52b, 2, 1, C_ALL, Q_UNIFYING, "Unifying Receiver (added 2015-05-30)") \
+	M(MX_REVOLUTION5, 0xb007, 1, 1, C_ALL, 0, "??? R0019 (added 2015-05-30)") \
+	M(MX_5500,        0xc71c, 1, 2, C_ALL, Q_EXPERIMENTAL, "keyboard/mouse combo")
+
+struct model
+{
+	int product, hidpp, index, cmds, quirks;
+	const char *what;
+};
+
+#define M_PRODUCT(n, p, v, i, c, q, w)	n = p,
+#define M_SLOT(n, p, v, i, c, q, w)		n##_slot,
+#define M_ENTRY(n, p, v, i, c, q, w)	{ p, v, i, c, q, w },
+#define M_CASE(n, p, v, i, c, q, w)		case n: return &models[n##_slot];
+
+enum { MODELS(M_PRODUCT) };
+enum { MODELS(M_SLOT) NMODELS };
+static const struct model models[NMODELS] = { MODELS(M_ENTRY) };
+
+static int all_devs;
+static int use_hidraw;
+static int mock_delay, mock_ndev;
+static long long deadline_at;	// ms, 0 for none
+static char *replay_file;
+static int replay_speed;		// 0 as fast as it goes
+static int monitor_min, monitor_max;	// s, 0 when not monitoring
+static int tuning;		// the daemon counts the wheel all along
+#ifndef LIBREVOCO
+static int tune_opt;
+static int pipeline;
+static int binary;
+static int if_changed;
+static char *compile_prog, *apply_prog;
+static char *focus_class, *focus_file;
+static int snapshot_opt;
+static char *capture_file, *decode_file;
+static int daemon_mode;
+static int daemon_hidraw, daemon_mock, daemon_delay;	// what each request starts from
+static int daemon_min, daemon_max;
+#endif
 
 /*** extracted from hiddev.h ***/
 
@@ -126,463 +191,4997 @@ struct hiddev_usage_ref_multi {
 #define HIDDEV_FLAG_REPORT	0x2
 #define HIDDEV_FLAGS		0x3
 
+#define HID_FIELD_INDEX_NONE	0xffffffff
+
+#define HID_GD_WHEEL		0x00010038
+
 /*** end hiddev.h ***/
 
+/*** extracted from hidraw.h ***/
+
+struct hidraw_devinfo {
+	u32 bustype;
+	s16 vendor;
+	s16 product;
+};
+
+#define HIDIOCGRAWINFO		_IOR('H', 0x03, struct hidraw_devinfo)
+#define HIDIOCGINPUT(len)	_IOC(_IOC_WRITE|_IOC_READ, 'H', 0x0A, len)
+
+/*** end hidraw.h ***/
+
+
+#define MAX_DEVS		16
+#define MAX_PENDING		16	// per device
+#define MAX_INDEX		6	// devices paired to a Unifying receiver
+#define MAX_FEATURES	32	// HID++ 2.0 feature indexes remembered per receiver
+
+#ifndef LIBREVOCO
+static int index_list[MAX_INDEX], nindex, index_all;	// --index
+#endif
+
+struct dev;
+
+enum { OP_CMD, OP_MODE, OP_BATTERY, OP_RECONNECT, OP_RAW, OP_QUERY, OP_DUMP, OP_SLEEP, OP_BENCH, OP_FEATURE,
+       OP_WAIT, OP_AT, OP_REPEAT, OP_STATUS, OP_TUNE };
+
+struct op
+{
+	int type;		// HID++ requests get the device index when they are sent
+	int arg1, arg2;
+	int n;			// number of values in buf
+	int buf[256];	// HID++ request or raw report
+	int ans[6];
+	int state;		// 0 pending, 1 answered, -1 rejected, 2 timed out
+	long long sent, done;	// in us
+	int tries;
+
+	/* while in flight */
+	long long due;		// ms
+	int alone;		// nothing else was in flight when it was sent
+	int once;		// dropped on timeout instead of sent again
+	void (*fn)(struct dev *, struct op *);	// it's done
+};
+
+/* wheel speeds seen, see tune_add() */
+#define TUNE_WINDOW		100		// ms a speed is counted over
+#define TUNE_BINS		64		// clicks per window, the last bin takes any more
+
+struct tune
+{
+	long long t;		// start of the current window, ms
+	int sum[2];		// clicks in it, up and down
+	unsigned int hist[2][TUNE_BINS], n[2];
+};
+
+struct watch
+{
+	int fd;
+	void (*fn)(struct watch *);
+	void *data;
+};
+
+struct dev
+{
+	int fd;
+	const struct transport *tp;
+	struct mock *mock;	// state of a simulated receiver
+	const struct model *model;
+	int first_byte;		// the model's default index
+	int product;
+	int paired;		// bit per index in use, -1 not asked yet
+	int idx[MAX_INDEX], nidx;	// where commands go
+	struct { int ix, id, index, wpid; } feat[MAX_FEATURES];
+	int nfeat;		// -1 not loaded yet
+	int wpid[MAX_INDEX + 1];	// wireless product ids the 0x41s told, by index
+	int hidpp1;		// bit per index that answered a HID++ 1.0 register
+	char path[256];
+	struct watch in, timer;
+	int srtt, rttvar;	// smoothed round trip and its deviation in us, 0 if unknown
+	int wheel[3];		// last wheel mode written
+	int wheel_state;	// 1 known, -1 unknown, 0 not looked up yet
+	int slot;		// in the daemon's status snapshot, or -1
+	struct tune tune;
+	long long poll_at, level_at;	// battery monitor, ms
+	int poll_ms, level, notified;
+
+	/* hiddev events go here instead of the request matching if set */
+	void (*event)(struct dev *, struct hiddev_usage_ref *);
+	int seen;
+
+	/* HID++ requests in flight, oldest first */
+	struct op *pend[MAX_PENDING];
+	int npend;
+
+	/* the batch being sent */
+	struct op *ops;
+	int n, sent, left, burst;
+};
+
+/* how to talk to a receiver: hiddev, hidraw or the mock */
+struct transport
+{
+	int (*info)(struct dev *);	// sets model, 0 if it's no mouse of ours
+	void (*setup)(struct dev *);
+	void (*write)(struct dev *, int id, const int *buf, int n);
+	void (*query)(struct dev *, int id, int *buf, int n);
+	void (*drain)(struct dev *);
+	void (*input)(struct watch *);
+};
+
+static const struct transport hiddev_tp, hidraw_tp, mock_tp;
+static void tune_event(struct dev *, struct hiddev_usage_ref *);
+
+
+/* in the daemon, a failing request must not take the whole process down */
+static jmp_buf *fatal_jmp;
+static int fatal_status;
+static char fatal_msg[2048];	// also what rv_error() tells
+
+static void quit(int status)
+{
+	if (fatal_jmp)
+	{
+		fatal_status = status;
+		longjmp(*fatal_jmp, 1);
+	}
+	exit(status);
+}
 
 static void fatal(const char *fmt, ...)
 {
 	va_list args;
 
 	va_start(args, fmt);
-	fprintf(stderr, "revoco: ");
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, "\n");
+	vsnprintf(fatal_msg, sizeof(fatal_msg), fmt, args);
 	va_end(args);
+#ifndef LIBREVOCO
+	fprintf(stderr, "revoco: %s\n", fatal_msg);
+#endif
 
-	exit(1);
+	quit(1);
 }
 
-static int wait_for_input(int fd, int timeout)
+/* goes on regardless; the library keeps it for rv_error() */
+static void warn(const char *fmt, ...)
 {
-	fd_set fds;
-	struct timeval tv, *tvp;;
+	va_list args;
 
-	tvp = 0;
-	if (timeout >= 0)
-	{
-		tv.tv_sec = timeout / 1000;
-		tv.tv_usec = timeout % 1000 * 1000;
-		tvp = &tv;
-	}
+	va_start(args, fmt);
+	vsnprintf(fatal_msg, sizeof(fatal_msg), fmt, args);
+	va_end(args);
+#ifndef LIBREVOCO
+	printf("%s\n", fatal_msg);
+#endif
+}
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+static long long now_us(void)
+{
+	struct timespec ts;
 
-	return select(fd + 1, &fds, NULL, NULL, tvp);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
-static void wait_report(int fd, int timeout)
+static long long now_ms(void)
 {
-	struct hiddev_usage_ref uref;
+	return now_us() / 1000;
+}
 
-	if (wait_for_input(fd, timeout) > 0)
-		while (read(fd, &uref, sizeof(uref)) > 0)
+/*** tracing ***/
+
+/*
+ * With --trace each step is logged to stderr when it ends: time since
+ * start, step, duration and details.  A daemon started with --trace
+ * also keeps a log2 histogram per step and prints it on SIGUSR1.
+ */
+enum { T_FIND, T_INIT, T_WRITE, T_ANSWER, T_TIMEOUT, T_QUERY, T_DRAIN, T_WAIT, T_SKIP, T_STEP, T_MONITOR, T_N };
+
+static const char *span_name[T_N] =
+{
+	"find", "init", "write", "answer", "timeout", "query", "drain", "wait", "skip", "step", "monitor"
+};
+
+static int trace, histogram;
+static long long trace_t0;
+static unsigned int hist[T_N][32];	// [i] counts durations of i bits (us)
+
+static void span(int kind, long long t, const struct dev *dev, const char *fmt, ...)
+{
+	long long now = now_us(), d = now - t;
+	va_list args;
+	int b;
+
+	if (histogram)
+	{
+		for (b = 0; b < 31 && d >> b; ++b)
 			;
+		hist[kind][b]++;
+	}
+	if (!trace)
+		return;
+
+	fprintf(stderr, "%10.3f %-7s %9.3f ms  ", (now - trace_t0) / 1000.0, span_name[kind], d / 1000.0);
+	if (dev && all_devs)
+		fprintf(stderr, "%s: ", dev->path);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
 }
 
-static int open_dev(char *path)
+static const char *hex(const int *buf, int n)
 {
-	char buf[128];
-	int i, fd;
-	struct hiddev_devinfo dinfo;
+	static char str[3 * 256 + 1];
+	char *p = str;
+	int i;
+
+	*p = '\0';
+	for (i = 0; i < n && i < 256; ++i)
+		p += sprintf(p, i ? " %02x" : "%02x", buf[i] & 0xff);
+	return str;
+}
+
+#ifndef LIBREVOCO
+static void hist_print(FILE *f)
+{
+	static const char bar[] = "########################################";
+	unsigned int total, max;
+	int k, b;
 
-	for (i = 0; i < 16; ++i)
+	for (k = 0; k < T_N; ++k)
 	{
-		sprintf(buf, path, i);
-		fd = open(buf, O_RDWR);
-		if (fd >= 0)
+		for (b = total = max = 0; b < 32; ++b)
 		{
-			if (ioctl(fd, HIDIOCGDEVINFO, &dinfo) == 0)
-				if (dinfo.vendor == (short)LOGITECH)
-				{
-					first_byte = 1;
-					if (dinfo.product == (short)MX_REVOLUTION)
-						return fd;
-					if (dinfo.product == (short)MX_REVOLUTION2)
-						return fd;
-					if (dinfo.product == (short)MX_REVOLUTION3)
-						return fd;
-					if (dinfo.product == (short)MX_REVOLUTION4)
-						return fd;
-					if (dinfo.product == (short)MX_REVOLUTION5)
-						return fd;
-					if (dinfo.product == (short)MX_5500)
-					{
-						first_byte = 2;
-						return fd;
-					}
-				}
-			close(fd);
+			total += hist[k][b];
+			if (hist[k][b] > max)
+				max = hist[k][b];
 		}
+		if (total == 0)
+			continue;
+
+		fprintf(f, "%s: %u\n", span_name[k], total);
+		for (b = 0; b < 32; ++b)
+			if (hist[k][b])
+				fprintf(f, "  < %10.3f ms %8u %.*s\n", (1LL << b) / 1000.0, hist[k][b],
+				        (int)((hist[k][b] * 40LL + max - 1) / max), bar);
 	}
-	return -1;
+	fflush(f);
+}
+#endif
+
+/*** event loop ***/
+
+static int ev_fd = -1;
+
+static void ev_add(struct watch *w, int fd, void (*fn)(struct watch *), void *data)
+{
+	struct epoll_event ev;
+
+	if (ev_fd == -1 && (ev_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("epoll_create: %s", strerror(errno));
+
+	w->fd = fd;
+	w->fn = fn;
+	w->data = data;
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		fatal("epoll_ctl: %s", strerror(errno));
 }
 
-static void init_dev(int fd)
+#ifndef LIBREVOCO
+static void ev_enable(struct watch *w, int on)
 {
-	int flag = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+	struct epoll_event ev;
 
-	if (fcntl(fd, F_SETFL, O_RDWR | O_NONBLOCK) == -1)
-		printf("fcntl(O_NONBLOCK): %s\n", strerror(errno));
-	if (ioctl(fd, HIDIOCSFLAG, &flag) == -1)
-		printf("HIDIOCSFLAG: %s\n", strerror(errno));
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.ptr = w;
+	epoll_ctl(ev_fd, EPOLL_CTL_MOD, w->fd, &ev);
 }
+#endif
 
-static void close_dev(int fd)
+static void ev_del(struct watch *w)
 {
-	close(fd);
+	if (w->fd != -1)
+		epoll_ctl(ev_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	w->fd = -1;
 }
 
-static void send_report(int fd, int id, const int *buf, int n)
+/*
+ * Dispatch whatever is ready, waiting at most until `deadline' (-1 for
+ * no limit).  Returns 0 on timeout.  Callbacks may run the loop again.
+ */
+static int ev_run(long long deadline)
 {
-	struct hiddev_usage_ref_multi uref;
-	struct hiddev_report_info rinfo;
-	int i;
+	struct epoll_event evs[32];
+	long long left;
+	int i, n, timeout = -1;
 
-	uref.uref.report_type = HID_REPORT_TYPE_OUTPUT;
-	uref.uref.report_id = id;
-	uref.uref.field_index = 0;
-	uref.uref.usage_index = 0;
-	uref.num_values = n;
+	if (deadline_at && (deadline < 0 || deadline > deadline_at))
+		deadline = deadline_at;
+	if (deadline >= 0)
+	{
+		left = deadline - now_ms();
+		timeout = left > 0 ? left : 0;
+	}
+
+	n = epoll_wait(ev_fd, evs, 32, timeout);
+	if (deadline_at && now_ms() >= deadline_at)
+		fatal("deadline exceeded");
 	for (i = 0; i < n; ++i)
-		uref.values[i] = buf[i];
-	if (ioctl(fd, HIDIOCSUSAGES, &uref) == -1)
-		fatal("send report %02x/%d, HIDIOCSUSAGES: %s", id, n, strerror(errno));
+	{
+		struct watch *w = evs[i].data.ptr;
 
-	rinfo.report_type = HID_REPORT_TYPE_OUTPUT;
-	rinfo.report_id = id;
-	rinfo.num_fields = 1;
-	if (ioctl(fd, HIDIOCSREPORT, &rinfo) == -1)
-		fatal("send report %02x/%d, HIDIOCSREPORT: %s", id, n, strerror(errno));
+		if (w->fd != -1)
+			w->fn(w);
+	}
+	return n > 0 ? n : 0;
+}
+
+#ifndef LIBREVOCO
+static void woken(struct watch *w)
+{
+	uint64_t n;
+
+	if (read(w->fd, &n, sizeof(n)) == sizeof(n))
+		*(int *)w->data = 1;
+}
+
+/*
+ * Keeps the loop running until `at' (us, monotonic).  Each caller has
+ * its own timerfd, callbacks sleeping meanwhile don't disturb it.  The
+ * watch is on the stack, so a fatal() in between must take it out of
+ * the loop before passing on.
+ */
+static void sleep_until(long long at)
+{
+	struct itimerspec it;
+	struct watch w;
+	jmp_buf jb, *old = fatal_jmp;
+	int tfd, done = 0;
+
+	if (at <= now_us())
+		return;
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		fatal("timerfd_create: %s", strerror(errno));
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = at / 1000000;
+	it.it_value.tv_nsec = at % 1000000 * 1000;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &it, NULL);
 
-	wait_report(fd, 3000);
+	ev_add(&w, tfd, woken, &done);
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		ev_del(&w);
+		close(tfd);
+		quit(fatal_status);
+	}
+	fatal_jmp = &jb;
+	while (!done)
+		ev_run(-1);
+	fatal_jmp = old;
+	ev_del(&w);
+	close(tfd);
 }
 
-static void query_report(int fd, int id, int *buf, int n)
+static void pause_ms(int ms)
 {
-	struct hiddev_usage_ref_multi uref;
-	struct hiddev_report_info rinfo;
-	int i;
+	sleep_until(now_us() + ms * 1000LL);
+}
+#endif
 
-	rinfo.report_type = HID_REPORT_TYPE_INPUT;
-	rinfo.report_id = id;
-	rinfo.num_fields = 1;
-	if (ioctl(fd, HIDIOCGREPORT, &rinfo) == -1)
-		fatal("query report %02x/%d, HIDIOCGREPORT: %s", id, n, strerror(errno));
+/* one-shot timer, `ms' < 0 disarms it */
+static void timer_set(struct watch *t, int ms)
+{
+	struct itimerspec it;
+
+	memset(&it, 0, sizeof(it));
+	if (ms >= 0)
+	{
+		it.it_value.tv_sec = ms / 1000;
+		it.it_value.tv_nsec = ms % 1000 * 1000000 + 1;
+	}
+	timerfd_settime(t->fd, 0, &it, NULL);
+}
+
+/*** device I/O ***/
 
-	wait_report(fd, 3000);
+static int get_usages(int fd, int type, int id, int *buf, int n)
+{
+	struct hiddev_usage_ref_multi uref;
+	int i;
 
-	uref.uref.report_type = HID_REPORT_TYPE_INPUT;
+	uref.uref.report_type = type;
 	uref.uref.report_id = id;
 	uref.uref.field_index = 0;
 	uref.uref.usage_index = 0;
 	uref.num_values = n;
 	if (ioctl(fd, HIDIOCGUSAGES, &uref) == -1)
-		fatal("query report %02x/%d, HIDIOCGUSAGES: %s", id, n, strerror(errno));
+		return -1;
 	for (i = 0; i < n; ++i)
 		buf[i] = uref.values[i];
+	return 0;
 }
 
-static void mx_cmd(int fd, int b1, int b2, int b3)
+/*
+ * A HID++ request `ix sub reg ...' is answered by `ix sub reg ...' or
+ * rejected with `ix 8f sub reg err' (`ix ff feature fn err' for HID++
+ * 2.0, where sub and reg are a feature index and function).  The device
+ * index is not compared, the MX-5500 answers requests for 2 as 1.  The
+ * pairing registers of a Unifying receiver all are 0xb5, the answer
+ * repeats which one it is.
+ */
+static int match_answer(const int *req, const int *ans)
 {
-	int buf[6] = { first_byte, 0x80, 0x56, b1, b2, b3 };
-
-	send_report(fd, 0x10, buf, 6);
+	if (ans[1] == req[1] && ans[2] == req[2])
+		return req[1] != 0x83 || req[2] != 0xb5 || ans[3] == req[3];
+	if ((ans[1] == 0x8f || ans[1] == 0xff) && ans[2] == req[1] && ans[3] == req[2])
+		return -1;
+	return 0;
 }
 
-static int mx_query(int fd, int b1, int *res)
+/* returns the receiver's descriptor or NULL if it's no mouse of ours */
+static const struct model *mx_model(int vendor, int product)
 {
-	int buf[6] = { first_byte, 0x81, b1, 0, 0, 0 };
-	int i;
+	if (vendor != LOGITECH)
+		return NULL;
 
-	send_report(fd, 0x10, buf, 6);
-	res[0] = -1;
-	query_report(fd, 0x10, res, 6);
-
-	if ((
-		res[0]  != 0x01 ||
-		res[1]  != 0x81 ||
-		(res[2] != 0xb1 && res[2] != 0x08)
-	) && (
-		(res[0] != 0x02 && res[0] != 0x01) ||
-		res[1]  != 0x81                    ||
-		(res[2] != 0x0d && res[2] != 0x08)
-	))
+	switch (product)
 	{
-		printf("bad answer:");
-		for (i = 0; i < 6; ++i)
-		{
-		  printf("%02X ", res[i]);
-		}
-		printf("\n");
-		return 0;
+		MODELS(M_CASE)
 	}
-	return 1;
+	return NULL;
 }
 
-static char * onearg(char *str, char prefix, int *arg, int def, int min, int max)
+static int set_model(struct dev *dev, int vendor, int product)
 {
-	char *end;
-	long n;
+	dev->product = product;
+	dev->model = mx_model(vendor, product);
+	dev->first_byte = dev->model ? dev->model->index : 0;
+	return dev->model != NULL;
+}
 
-	*arg = def;
+static int hiddev_info(struct dev *dev)
+{
+	struct hiddev_devinfo dinfo;
 
-	if (*str == '\0')
-		return str;
+	if (ioctl(dev->fd, HIDIOCGDEVINFO, &dinfo) == -1)
+		return set_model(dev, 0, 0);
+	return set_model(dev, dinfo.vendor & 0xffff, dinfo.product & 0xffff);
+}
 
-	if (*str != prefix)
-		fatal("bad argument `%s': `%c' expected", str, prefix);
+static int hidraw_info(struct dev *dev)
+{
+	struct hidraw_devinfo rinfo;
 
-	n = strtol(++str, &end, 0);
-	if (str != end)
-	{
-		*arg = n;
-		if (n < min || n > max)
-			fatal("argument `%.*s' out of range (%d-%d)", end - str, str, min, max);
-	}
-	return end;
+	if (ioctl(dev->fd, HIDIOCGRAWINFO, &rinfo) == -1)
+		return set_model(dev, 0, 0);
+	return set_model(dev, rinfo.vendor & 0xffff, rinfo.product & 0xffff);
 }
 
-static void twoargs(char *str, int *arg1, int *arg2, int def, int min, int max)
+/* opens the node `path' into devs[n] and returns the new number of devices */
+static int add_dev(struct dev *devs, int n, const char *path, const struct transport *tp)
 {
-	char *p = str;
+	struct dev *dev = &devs[n];
 
-	p = onearg(p, '=', arg1, def, min, max);
-	p = onearg(p, ',', arg2, *arg1, min, max);
-	if (*p)
-		fatal("malformed argument `%s'", str);
+	dev->tp = tp;
+	if ((dev->fd = open(path, O_RDWR)) == -1)
+		return n;
+	if (!tp->info(dev))
+	{
+		close(dev->fd);
+		return n;
+	}
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	return n + 1;
 }
 
-static int nargs(char *str, int *buf, int n, int def, int min, int max)
+static int open_dev(char *path, struct dev *devs, int max)
 {
-	char *p = str;
-	int i = 0, del = '=';
+	char buf[128];
+	int i, n = 0;
 
-	while (n--)
+	for (i = 0; i < 16 && n < max; ++i)
 	{
-		if (*p)
-			i++;
-		p = onearg(p, del, buf++, def, min, max);
-		del = ',';
+		sprintf(buf, path, i);
+		n = add_dev(devs, n, buf, &hiddev_tp);
 	}
-	if (*p)
-		fatal("malformed argument `%s'", str);
-	return i;
+	return n;
 }
 
-static void configure(int handle, int argc, char **argv)
+static int read_hex(const char *dir, const char *name)
 {
-	int i, arg1, arg2;
+	char path[512], buf[16];
+	int fd, n;
 
-	for (i = 1; i < argc; ++i)
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	return strtol(buf, NULL, 16);
+}
+
+/*
+ * Look up the IDs of the hiddev nodes in sysfs and open only the
+ * matching ones, so unrelated HID devices are left alone.  Returns -2
+ * when sysfs is of no help and the nodes have to be probed.
+ */
+static int sysfs_dev(struct dev *devs, int max)
+{
+	static const char *nodes[] = { "/dev/usb/%s", "/dev/%s" };
+	char dir[512], path[300];
+	struct dirent *de;
+	DIR *d;
+	int i, m, n = 0, found = 0;
+
+	if ((d = opendir("/sys/class/usbmisc")) == NULL)
+		return -2;
+
+	while (n < max && (de = readdir(d)))
 	{
-		int perm = 0x80;
-		char *cmd = argv[i];
+		if (!strneq(de->d_name, "hiddev", 6))
+			continue;
 
-		if (strneq(cmd, "temp-", 5))
-			perm = 0, cmd += 5;
+		snprintf(dir, sizeof(dir), "/sys/class/usbmisc/%s/device/..", de->d_name);
+		if (!mx_model(read_hex(dir, "idVendor"), read_hex(dir, "idProduct")))
+			continue;
 
-		if (streq(cmd, "free"))
+		found++;
+		for (i = 0, m = n; n == m && i < 2; ++i)
 		{
-			mx_cmd(handle, perm + 1, 0, 0);
+			snprintf(path, sizeof(path), nodes[i], de->d_name);
+			n = add_dev(devs, n, path, &hiddev_tp);
 		}
-		else if (streq(cmd, "click"))
-		{
-			mx_cmd(handle, perm + 2, 0, 0);
-		}
-		else if (strneq(cmd, "manual", 6))
-		{
-			twoargs(cmd + 6, &arg1, &arg2, 0, 0, 15);
-			if (arg1 != arg2)
-				mx_cmd(handle, perm + 7, arg1 * 16 + arg2, 0);
-			else
-				mx_cmd(handle, perm + 8, arg1, 0);
-		}
-		else if (strneq(cmd, "auto", 4))
-		{
-			twoargs(cmd + 4, &arg1, &arg2, 0, 0, 50);
-			mx_cmd(handle, perm + 5, arg1, arg2);
-		}
-		else if (strneq(argv[i], "soft-free", 9))
-		{
-			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
-			mx_cmd(handle, 3, arg1, arg2);
-		}
-		else if (strneq(argv[i], "soft-click", 10))
+	}
+	closedir(d);
+
+	if (n < found)
+	{
+		while (n)
+			close(devs[--n].fd);
+		return -2;
+	}
+	return n;
+}
+
+/* does the report descriptor declare the HID++ report 0x10? */
+static int has_hidpp(const char *dir)
+{
+	unsigned char d[4096];
+	char path[320];
+	int fd, i, n, size;
+
+	snprintf(path, sizeof(path), "%s/report_descriptor", dir);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	n = read(fd, d, sizeof(d));
+	close(fd);
+
+	for (i = 0; i < n; i += 1 + size)
+	{
+		if (d[i] == 0xfe)		// long item
 		{
-			twoargs(argv[i] + 10, &arg1, &arg2, 0, 0, 255);
-			mx_cmd(handle, 4, arg1, arg2);
+			size = i + 1 < n ? d[i + 1] + 2 : 0;
+			continue;
 		}
-		else if (strneq(argv[i], "reconnect", 9))
+		size = (d[i] & 3) == 3 ? 4 : d[i] & 3;
+		if (d[i] == 0x85 && i + 1 < n && d[i + 1] == 0x10)
+			return 1;
+	}
+	return 0;
+}
+
+/* whether the HID device in `dir' is a receiver we know, by the HID_ID of its uevent */
+static int hid_id(const char *dir)
+{
+	char path[600], buf[512], *p;
+	unsigned int bus, vendor, product;
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/uevent", dir);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	if ((p = strstr(buf, "HID_ID=")) == NULL ||
+	    sscanf(p + 7, "%x:%x:%x", &bus, &vendor, &product) != 3)
+		return 0;
+	return mx_model(vendor, product) != NULL;
+}
+
+/*
+ * A receiver has several hidraw nodes, one per interface.  The one to
+ * talk to is the one with the HID++ reports.
+ */
+static int hidraw_dev(struct dev *devs, int max)
+{
+	char dir[300], path[320];
+	struct dirent *de;
+	DIR *d;
+	int n = 0;
+
+	if ((d = opendir("/sys/class/hidraw")) == NULL)
+		return 0;
+
+	while (n < max && (de = readdir(d)))
+	{
+		if (!strneq(de->d_name, "hidraw", 6))
+			continue;
+
+		snprintf(dir, sizeof(dir), "/sys/class/hidraw/%s/device", de->d_name);
+		if (!hid_id(dir) || !has_hidpp(dir))
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		n = add_dev(devs, n, path, &hidraw_tp);
+	}
+	closedir(d);
+	return n;
+}
+
+static void hiddev_write(struct dev *dev, int id, const int *buf, int n)
+{
+	struct hiddev_usage_ref_multi uref;
+	struct hiddev_report_info rinfo;
+	int i;
+
+	uref.uref.report_type = HID_REPORT_TYPE_OUTPUT;
+	uref.uref.report_id = id;
+	uref.uref.field_index = 0;
+	uref.uref.usage_index = 0;
+	uref.num_values = n;
+	for (i = 0; i < n; ++i)
+		uref.values[i] = buf[i];
+	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref) == -1)
+		fatal("send report %02x/%d, HIDIOCSUSAGES: %s", id, n, strerror(errno));
+
+	rinfo.report_type = HID_REPORT_TYPE_OUTPUT;
+	rinfo.report_id = id;
+	rinfo.num_fields = 1;
+	if (ioctl(dev->fd, HIDIOCSREPORT, &rinfo) == -1)
+		fatal("send report %02x/%d, HIDIOCSREPORT: %s", id, n, strerror(errno));
+}
+
+/* one write, the report id goes first */
+static void hidraw_write(struct dev *dev, int id, const int *buf, int n)
+{
+	unsigned char r[64];
+	int i;
+
+	r[0] = id;
+	for (i = 0; i < n && i < sizeof(r) - 1; ++i)
+		r[i + 1] = buf[i];
+	if (write(dev->fd, r, i + 1) != i + 1)
+		fatal("send report %02x/%d: %s", id, n, strerror(errno));
+}
+
+/* hiddev events or hidraw reports, whatever is queued goes */
+static void fd_drain(struct dev *dev)
+{
+	struct hiddev_usage_ref ev[64];
+
+	while (read(dev->fd, ev, sizeof(ev)) > 0)
+		;
+}
+
+static void hiddev_query(struct dev *dev, int id, int *buf, int n)
+{
+	struct hiddev_report_info rinfo;
+
+	rinfo.report_type = HID_REPORT_TYPE_INPUT;
+	rinfo.report_id = id;
+	rinfo.num_fields = 1;
+	if (ioctl(dev->fd, HIDIOCGREPORT, &rinfo) == -1)
+		fatal("query report %02x/%d, HIDIOCGREPORT: %s", id, n, strerror(errno));
+
+	/* HIDIOCGREPORT waits for the transfer, just drop queued events */
+	fd_drain(dev);
+
+	if (get_usages(dev->fd, HID_REPORT_TYPE_INPUT, id, buf, n) == -1)
+		fatal("query report %02x/%d, HIDIOCGUSAGES: %s", id, n, strerror(errno));
+}
+
+static void hidraw_query(struct dev *dev, int id, int *buf, int n)
+{
+	unsigned char r[64];
+	int i;
+
+	memset(r, 0, sizeof(r));
+	r[0] = id;
+	if (n > sizeof(r) - 1 || ioctl(dev->fd, HIDIOCGINPUT(n + 1), r) == -1)
+		fatal("query report %02x/%d, HIDIOCGINPUT: %s", id, n, strerror(errno));
+	fd_drain(dev);
+	for (i = 0; i < n; ++i)
+		buf[i] = r[i + 1];
+}
+
+/*** wheel state ***/
+
+/*
+ * Files in $XDG_RUNTIME_DIR.  Without one (root under sudo or udev)
+ * they go to /tmp/revoco-<uid>, which has to be our own directory that
+ * nobody else can write to.  If it isn't, there are no runtime files,
+ * nothing is cached, and 0 is returned.
+ */
+static int runtime_file(char *buf, int size, const char *ext)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char own[64];
+	struct stat sb;
+
+	if (!dir)
+	{
+		snprintf(own, sizeof(own), "/tmp/revoco-%d", (int)getuid());
+		mkdir(own, 0700);
+		if (lstat(own, &sb) == -1 || !S_ISDIR(sb.st_mode) ||
+		    sb.st_uid != getuid() || (sb.st_mode & 077))
+		{
+			*buf = '\0';
+			return 0;
+		}
+		dir = own;
+	}
+	snprintf(buf, size, "%s/revoco.%s", dir, ext);
+	return 1;
+}
+
+/* a new file of our own next to `name', renamed over it when complete */
+static FILE *tmp_file(const char *name, char *tmp, int size)
+{
+	FILE *f;
+	int fd;
+
+	snprintf(tmp, size, "%s.XXXXXX", name);
+	if ((fd = mkstemp(tmp)) == -1)
+		return NULL;
+	if ((f = fdopen(fd, "w")) == NULL)
+	{
+		close(fd);
+		unlink(tmp);
+	}
+	return f;
+}
+
+/* hiddev's bus and device number tell a replugged receiver apart */
+static int dev_ids(struct dev *dev, unsigned int *bus, unsigned int *devnum)
+{
+	struct hiddev_devinfo dinfo;
+
+	if (dev->tp != &hiddev_tp || ioctl(dev->fd, HIDIOCGDEVINFO, &dinfo) == -1)
+		return 0;
+	*bus = dinfo.busnum;
+	*devnum = dinfo.devnum;
+	return 1;
+}
+
+#ifndef LIBREVOCO
+/*
+ * The last wheel mode (the bytes of the 0x56 write) each receiver took,
+ * for --if-changed.  The daemon has it in memory, a single run looks in
+ * the state file: lines of `path busnum devnum b1 b2 b3'.
+ */
+static void wheel_load(struct dev *dev)
+{
+	unsigned int bus, devnum, b, d;
+	char name[512], path[256];
+	int w[3];
+	FILE *f;
+
+	dev->wheel_state = -1;
+	if (!runtime_file(name, sizeof(name), "state") ||
+	    !dev_ids(dev, &bus, &devnum) || (f = fopen(name, "r")) == NULL)
+		return;
+	while (fscanf(f, "%255s %u %u %d %d %d", path, &b, &d, &w[0], &w[1], &w[2]) == 6)
+		if (streq(path, dev->path) && b == bus && d == devnum)
+		{
+			memcpy(dev->wheel, w, sizeof(w));
+			dev->wheel_state = 1;
+		}
+	fclose(f);
+}
+#endif
+
+/* written right away, a run cut short must not leave a stale entry */
+static void wheel_save(struct dev *dev)
+{
+	char name[512], tmp[520], line[300], path[256];
+	unsigned int bus, devnum;
+	FILE *f, *g;
+
+	if (!dev_ids(dev, &bus, &devnum) || !runtime_file(name, sizeof(name), "state") ||
+	    (g = tmp_file(name, tmp, sizeof(tmp))) == NULL)
+		return;
+	if ((f = fopen(name, "r")))
+	{
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "%255s", path) == 1 && !streq(path, dev->path))
+				fputs(line, g);
+		fclose(f);
+	}
+	if (dev->wheel_state == 1)
+		fprintf(g, "%s %u %u %d %d %d\n", dev->path, bus, devnum,
+		        dev->wheel[0], dev->wheel[1], dev->wheel[2]);
+	if (fclose(g) != 0 || rename(tmp, name) == -1)
+		unlink(tmp);
+}
+
+/* `req' went through (`r' 1), was rejected or got lost */
+static void wheel_set(struct dev *dev, const int *req, int r)
+{
+	if (req[0] != dev->first_byte || req[1] != 0x80 || req[2] != 0x56)
+		return;
+	if (r == 1 && dev->wheel_state == 1 && !memcmp(dev->wheel, req + 3, sizeof(dev->wheel)))
+		return;
+
+	dev->wheel_state = r == 1 ? 1 : -1;
+	memcpy(dev->wheel, req + 3, sizeof(dev->wheel));
+	wheel_save(dev);
+}
+
+#ifndef LIBREVOCO
+/*
+ * The mode button flips between free and click behind our back, so
+ * the cache is not trusted to drop such a write: a free or click mode
+ * the first write of the batch would repeat needs a look at 0x08.
+ */
+static int wheel_doubt(struct dev *dev, const struct op *ops, int n)
+{
+	int i, mode;
+
+	if (dev->wheel_state == 0)
+		wheel_load(dev);
+	mode = dev->wheel[0] & 0x7f;
+	if (dev->wheel_state != 1 || (mode != 1 && mode != 2))
+		return 0;
+
+	for (i = 0; i < n; ++i)
+		if (ops[i].type == OP_CMD && ops[i].buf[0] == dev->first_byte)
+			return !memcmp(dev->wheel, ops[i].buf + 3, sizeof(dev->wheel));
+	return 0;
+}
+
+/*
+ * Drops the writes of wheel modes the device already has from a batch,
+ * returns what is left.  Only the receiver's own index is remembered,
+ * writes to other paired devices always go out.
+ */
+static int wheel_filter(struct dev *dev, struct op *ops, int n)
+{
+	int i, m = 0, known, cur[3];
+
+	if (dev->wheel_state == 0)
+		wheel_load(dev);
+	known = dev->wheel_state == 1;
+	memcpy(cur, dev->wheel, sizeof(cur));
+
+	for (i = 0; i < n; ++i)
+	{
+		if (ops[i].type == OP_CMD && ops[i].buf[0] == dev->first_byte)
+		{
+			if (known && !memcmp(cur, ops[i].buf + 3, sizeof(cur)))
+			{
+				span(T_SKIP, now_us(), dev, "%s", hex(ops[i].buf, ops[i].n));
+				continue;
+			}
+			memcpy(cur, ops[i].buf + 3, sizeof(cur));
+			known = 1;
+		}
+		if (m != i)
+			ops[m] = ops[i];
+		m++;
+	}
+	return m;
+}
+#endif
+
+/*** HID++ 2.0 feature cache ***/
+
+/*
+ * HID++ 2.0 devices are talked to through feature indexes, looked up
+ * by feature id with IRoot.  They only change when the device does, so
+ * they are kept in the runtime dir, keyed by the receiver's product and
+ * USB serial and the device index: lines of `key ix feature index wpid'.
+ * The wireless product id (0 if not known yet) tells which device was
+ * paired at that index; the receiver says so when one connects.
+ */
+static int read_str(const char *dir, const char *name, char *buf, int size)
+{
+	char path[512];
+	int fd, n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		n--;
+	buf[n > 0 ? n : 0] = '\0';
+	return n > 0 && !strpbrk(buf, " \t\n");
+}
+
+static void dev_key(struct dev *dev, char *buf, int size)
+{
+	const char *name = strrchr(dev->path, '/');
+	char dir[320], serial[64];
+
+	name = name ? name + 1 : dev->path;
+	if (dev->tp == &hiddev_tp)
+		snprintf(dir, sizeof(dir), "/sys/class/usbmisc/%s/device/..", name);
+	else
+		snprintf(dir, sizeof(dir), "/sys/class/hidraw/%s/device/../..", name);
+	if (dev->tp == &mock_tp || !read_str(dir, "serial", serial, sizeof(serial)))
+		snprintf(serial, sizeof(serial), "%.60s", name);
+	snprintf(buf, size, "%04x:%s", dev->product, serial);
+}
+
+static void feature_load(struct dev *dev)
+{
+	char name[512], line[300], key[128], k[128];
+	int ix, id, index, wpid;
+	FILE *f;
+
+	dev->nfeat = 0;
+	dev_key(dev, key, sizeof(key));
+	if (!runtime_file(name, sizeof(name), "features") || (f = fopen(name, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "%127s %d %x %d %x", k, &ix, &id, &index, &wpid) == 5 &&
+		    streq(k, key) && dev->nfeat < MAX_FEATURES)
+		{
+			dev->feat[dev->nfeat].ix = ix;
+			dev->feat[dev->nfeat].id = id;
+			dev->feat[dev->nfeat].index = index;
+			dev->feat[dev->nfeat++].wpid = wpid;
+		}
+	fclose(f);
+}
+
+static void feature_save(struct dev *dev)
+{
+	char name[512], tmp[520], line[300], key[128], k[128];
+	FILE *f, *g;
+	int i;
+
+	dev_key(dev, key, sizeof(key));
+	if (!runtime_file(name, sizeof(name), "features") ||
+	    (g = tmp_file(name, tmp, sizeof(tmp))) == NULL)
+		return;
+	if ((f = fopen(name, "r")))
+	{
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "%127s", k) == 1 && !streq(k, key))
+				fputs(line, g);
+		fclose(f);
+	}
+	for (i = 0; i < dev->nfeat; ++i)
+		fprintf(g, "%s %d %04x %d %04x\n", key, dev->feat[i].ix, dev->feat[i].id,
+		        dev->feat[i].index, dev->feat[i].wpid);
+	if (fclose(g) != 0 || rename(tmp, name) == -1)
+		unlink(tmp);
+}
+
+/*
+ * Drops what is known about index `ix', unless it was learned from the
+ * device of wireless product id `wpid' (0 for whichever it was).  A
+ * device that says it has no such feature index was paired anew.
+ */
+static void feature_forget(struct dev *dev, int ix, int wpid)
+{
+	int i, n = 0;
+
+	if (dev->nfeat < 0)
+		feature_load(dev);
+	for (i = 0; i < dev->nfeat; ++i)
+		if (dev->feat[i].ix != ix || (wpid && dev->feat[i].wpid == wpid))
+			dev->feat[n++] = dev->feat[i];
+	if (n != dev->nfeat)
+	{
+		dev->nfeat = n;
+		feature_save(dev);
+	}
+}
+
+/*** status snapshot ***/
+
+/*
+ * The daemon publishes what it last heard about battery and wheel mode
+ * in a shared file, so monitoring doesn't have to wake the mouse.  It is
+ * a seqlock: the writer makes `seq' odd while it changes things, a
+ * reader copies everything and tries again if `seq' was odd or moved.
+ */
+#define STATUS_MAGIC	0x73637672	// "rvcs"
+
+struct status
+{
+	unsigned int magic;
+	unsigned int seq;
+	int pid;
+	int ndev;
+	struct
+	{
+		char path[64];
+		int product;
+		int battery, charge;	// level in %, status byte; -1 unknown
+		int click;		// -1 unknown
+		long long battery_time, mode_time;	// ms since the epoch
+	} dev[MAX_DEVS];
+};
+
+static struct status *status;
+static struct watch monitor_timer;
+static long long monitor_at;
+
+static long long wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void status_begin(void)
+{
+	__atomic_store_n(&status->seq, status->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_end(void)
+{
+	__atomic_store_n(&status->seq, status->seq + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef LIBREVOCO
+/* made anew and renamed into place, whatever was there is left alone */
+static void status_open(void)
+{
+	char name[512], tmp[520];
+	void *p;
+	int fd;
+
+	if (!runtime_file(name, sizeof(name), "status"))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+	if ((fd = mkstemp(tmp)) == -1)
+		fatal("%s: %s", tmp, strerror(errno));
+	if (fchmod(fd, 0644) == -1 || ftruncate(fd, sizeof(*status)) == -1 ||
+	    (p = mmap(NULL, sizeof(*status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+	    rename(tmp, name) == -1)
+	{
+		unlink(tmp);
+		fatal("%s: %s", name, strerror(errno));
+	}
+	close(fd);
+
+	status = p;
+	status->pid = getpid();
+	status->magic = STATUS_MAGIC;
+}
+
+static void status_devs(struct dev *devs, int n)
+{
+	int i;
+
+	status_begin();
+	memset(status->dev, 0, sizeof(status->dev));
+	for (i = 0; i < n; ++i)
+	{
+		snprintf(status->dev[i].path, sizeof(status->dev[i].path), "%s", devs[i].path);
+		status->dev[i].product = devs[i].product;
+		status->dev[i].battery = status->dev[i].charge = status->dev[i].click = -1;
+		devs[i].slot = i;
+	}
+	status->ndev = n;
+	status_end();
+}
+#endif
+
+static void monitor_due(long long at)
+{
+	long long now = now_ms();
+
+	if (monitor_at && monitor_at <= at)
+		return;
+	monitor_at = at;
+	timer_set(&monitor_timer, at > now ? at - now : 0);
+}
+
+/*
+ * Every radio transaction costs the mouse some battery, so the monitor
+ * asks as rarely as it can.  A level that keeps still doubles the
+ * interval, a falling one is asked again when the next percent is due
+ * at the rate it went so far.  Charging or nearly empty batteries are
+ * watched closely, unless the mouse tells about changes by itself.
+ */
+static void battery_seen(struct dev *dev, int level, int charge, int note)
+{
+	long long now = now_ms();
+	int ms;
+
+	if (status && dev->slot >= 0)
+	{
+		status_begin();
+		status->dev[dev->slot].battery = level;
+		status->dev[dev->slot].charge = charge;
+		status->dev[dev->slot].battery_time = wall_ms();
+		status_end();
+	}
+	if (!monitor_max)
+		return;
+
+	dev->notified |= note;
+	if (dev->notified)
+		ms = monitor_max * 1000;
+	else if (charge == 0x50 || level <= 10)
+		ms = monitor_min * 1000;
+	else if (dev->level > level)
+		ms = (now - dev->level_at) / (dev->level - level);
+	else
+		ms = dev->poll_ms * 2;
+
+	if (ms < monitor_min * 1000)
+		ms = monitor_min * 1000;
+	if (ms > monitor_max * 1000)
+		ms = monitor_max * 1000;
+	if (level != dev->level)
+		dev->level = level, dev->level_at = now;
+	dev->poll_ms = ms;
+	monitor_due(dev->poll_at = now + ms);
+	span(T_MONITOR, now * 1000, dev, "battery %d%%, next look in %d s", level, ms / 1000);
+}
+
+/* an answer to `req' came in */
+static void status_answer(struct dev *dev, const int *req, const int *ans)
+{
+	int mode = req[3] & 0x7f;
+
+	if (req[0] != dev->first_byte)
+		return;
+	if (req[1] == 0x81 && req[2] == 0x0d)
+	{
+		battery_seen(dev, ans[3], ans[5], 0);
+		return;
+	}
+	if (!status || dev->slot < 0)
+		return;
+
+	status_begin();
+	if (req[1] == 0x81 && req[2] == 0x08)
+	{
+		status->dev[dev->slot].click = ans[5] & 1;
+		status->dev[dev->slot].mode_time = wall_ms();
+	}
+	else if (req[1] == 0x80 && req[2] == 0x56 && (mode == 1 || mode == 2))
+	{
+		status->dev[dev->slot].click = mode == 2;
+		status->dev[dev->slot].mode_time = wall_ms();
+	}
+	status_end();
+}
+
+/*
+ * 0x0d is a battery change, but only from a HID++ 1.0 device: from 2.0
+ * it's an event of feature index 0x0d.  Models that may have 2.0 devices
+ * take it only from an index that answered a 1.0 register.  0x40 is a
+ * device unpaired, 0x41 one connecting (link lost if bit 6 of byte 3,
+ * the wireless product id in bytes 4 and 5).  Either may be a different
+ * device at that index now.
+ */
+static void notification(struct dev *dev, const int *buf)
+{
+	int ix = buf[0], wpid = buf[5] << 8 | buf[4];
+	int hidpp1 = dev->model->hidpp < 2 || (ix >= 1 && ix <= MAX_INDEX && dev->hidpp1 & 1 << ix);
+
+	if (buf[1] == 0x0d && hidpp1 && (ix == dev->first_byte || !(dev->model->quirks & Q_UNIFYING)))
+		battery_seen(dev, buf[2], buf[4], 1);
+	else if (ix < 1 || ix > MAX_INDEX)
+		return;
+	else if (buf[1] == 0x40)
+	{
+		feature_forget(dev, ix, 0);
+		dev->wpid[ix] = 0;
+		dev->hidpp1 &= ~(1 << ix);
+	}
+	else if (buf[1] == 0x41 && !(buf[3] & 0x40))
+	{
+		feature_forget(dev, ix, wpid);
+		if (wpid != dev->wpid[ix])
+			dev->hidpp1 &= ~(1 << ix);
+		dev->wpid[ix] = wpid;
+	}
+}
+
+/*** requests ***/
+
+static void write_report(struct dev *dev, int id, const int *buf, int n)
+{
+	long long t = now_us();
+
+	dev->tp->write(dev, id, buf, n);
+	span(T_WRITE, t, dev, "%02x: %s", id, hex(buf, n));
+}
+
+#ifndef LIBREVOCO
+static void query_report(struct dev *dev, int id, int *buf, int n)
+{
+	long long t = now_us();
+
+	dev->tp->query(dev, id, buf, n);
+	span(T_QUERY, t, dev, "%02x: %s", id, hex(buf, n));
+}
+
+static void dev_drain(struct dev *dev)
+{
+	long long t = now_us();
+
+	dev->tp->drain(dev);
+	span(T_DRAIN, t, dev, "");
+}
+#endif
+
+/*
+ * Timeouts follow the round trips seen so far, like TCP's (RFC 6298):
+ * srtt + 4 * rttvar, doubled for every retry.  Only answers to requests
+ * sent once are measured, a late answer to the previous try would make
+ * the link look faster than it is.
+ */
+#define RTO_INIT	1000	// ms, while nothing has been measured
+#define RTO_MIN		100
+#define RTO_MAX		8000
+#define MAX_TRIES	3
+
+static int dev_rto(struct dev *dev, int tries)
+{
+	int rto = dev->srtt ? (dev->srtt + 4 * dev->rttvar) / 1000 : RTO_INIT;
+
+	rto <<= tries;
+	return rto < RTO_MIN ? RTO_MIN : rto > RTO_MAX ? RTO_MAX : rto;
+}
+
+static void rtt_sample(struct dev *dev, long long us)
+{
+	int r = us > 0 ? us : 1;
+
+	if (dev->srtt == 0)
+	{
+		dev->srtt = r;
+		dev->rttvar = r / 2;
+	}
+	else
+	{
+		dev->rttvar += (abs(dev->srtt - r) - dev->rttvar) / 4;
+		dev->srtt += (r - dev->srtt) / 8;
+	}
+}
+
+/*
+ * The table of requests in flight.  An answer is for the oldest one
+ * with its device index, sub-id and register, or if there is none with
+ * that index, the oldest with the sub-id and register (the MX-5500
+ * answers requests for 2 as 1).  Every request has its own timeout.
+ */
+static void req_arm(struct dev *dev)
+{
+	long long due = -1;
+	int i;
+
+	for (i = 0; i < dev->npend; ++i)
+		if (due < 0 || dev->pend[i]->due < due)
+			due = dev->pend[i]->due;
+	timer_set(&dev->timer, due < 0 ? -1 : due > now_ms() ? due - now_ms() : 0);
+}
+
+static void req_send(struct dev *dev, struct op *op)
+{
+	if (dev->npend == MAX_PENDING)
+		fatal("%s: too many requests in flight", dev->path);
+
+	op->state = 0;
+	op->alone = dev->npend == 0;
+	op->sent = now_us();
+	op->due = op->sent / 1000 + dev_rto(dev, op->tries);
+	/* in the table only once it went out, a failed write is the caller's */
+	write_report(dev, 0x10, op->buf, op->n);
+	dev->pend[dev->npend++] = op;
+	req_arm(dev);
+}
+
+static int req_find(struct dev *dev, const int *ans, int *r)
+{
+	int i, any = -1;
+
+	for (i = 0; i < dev->npend; ++i)
+		if ((*r = match_answer(dev->pend[i]->buf, ans)))
+		{
+			if (dev->pend[i]->buf[0] == ans[0])
+				return i;
+			if (any < 0)
+				any = i;
+		}
+	if (any >= 0)
+		*r = match_answer(dev->pend[any]->buf, ans);
+	return any;
+}
+
+/* takes pend[i] out of the table with `state' */
+static void req_done(struct dev *dev, int i, int state)
+{
+	struct op *op = dev->pend[i];
+
+	memmove(dev->pend + i, dev->pend + i + 1, (--dev->npend - i) * sizeof(*dev->pend));
+	op->state = state;
+	req_arm(dev);
+	if (op->fn)
+		op->fn(dev, op);
+}
+
+/* forget everything in flight */
+static void req_clear(struct dev *dev)
+{
+	dev->npend = 0;
+	timer_set(&dev->timer, -1);
+}
+
+/* sort an incoming HID++ frame to its request */
+static int req_frame(struct dev *dev, const int *buf)
+{
+	struct op *op;
+	int i, j, r;
+
+	if ((i = req_find(dev, buf, &r)) < 0)
+		return 0;
+
+	op = dev->pend[i];
+	memcpy(op->ans, buf, sizeof(op->ans));
+	op->done = now_us();
+	span(T_ANSWER, op->sent, dev, "%s", hex(buf, 6));
+	wheel_set(dev, op->buf, r);
+	if (r == 1)
+		status_answer(dev, op->buf, buf);
+	if (r == 1 && (buf[1] & 0xf0) == 0x80 && buf[0] >= 1 && buf[0] <= MAX_INDEX)
+		dev->hidpp1 |= 1 << buf[0];
+	if (buf[1] == 0xff && buf[4] == 0x06)	// invalid feature index
+		feature_forget(dev, buf[0], 0);
+
+	/* requests that had to queue behind others don't tell the round trip */
+	if (op->tries == 0 && op->alone)
+		rtt_sample(dev, op->done - op->sent);
+
+	/* the device is alive, what is still queued there gets more time */
+	for (j = 0; j < dev->npend; ++j)
+		if (dev->pend[j]->due < now_ms() + dev_rto(dev, dev->pend[j]->tries))
+			dev->pend[j]->due = now_ms() + dev_rto(dev, dev->pend[j]->tries);
+
+	req_done(dev, i, r);
+	return 1;
+}
+
+/*
+ * Nothing came back in time.  The request is sent again a few times,
+ * after that a lost get-register answer may still be sitting in the
+ * report (the library doesn't look, that blocks).  Requests of a burst
+ * are dropped at once, they are redone one at a time afterwards.
+ */
+static void req_timeout(struct dev *dev)
+{
+	struct op *op;
+	int i;
+
+	for (i = 0; i < dev->npend; )
+	{
+		op = dev->pend[i];
+		if (op->due > now_ms())
+		{
+			i++;
+			continue;
+		}
+		span(T_TIMEOUT, op->sent, dev, "%s, try %d", hex(op->buf, op->n), op->tries + 1);
+
+		if (op->once)
+			req_done(dev, i, 0);
+		else if (++op->tries < MAX_TRIES)
+		{
+			op->sent = now_us();
+			op->due = op->sent / 1000 + dev_rto(dev, op->tries);
+			write_report(dev, 0x10, op->buf, op->n);
+			i++;
+		}
+#ifndef LIBREVOCO
+		else if (op->buf[1] == 0x81)
+		{
+			query_report(dev, 0x10, op->ans, 6);
+			op->done = now_us();
+			req_done(dev, i, match_answer(op->buf, op->ans) == 1 ? 1 : 2);
+		}
+#endif
+		else
+		{
+			wheel_set(dev, op->buf, 2);
+			req_done(dev, i, 2);
+		}
+	}
+	req_arm(dev);
+}
+
+/*
+ * A batch is a list of requests sent one after the other, or as a
+ * burst all at once (as many as the table takes).
+ */
+static void batch_done(struct dev *dev, struct op *op);
+
+static void batch_send(struct dev *dev)
+{
+	struct op *op;
+
+	do
+	{
+		op = &dev->ops[dev->sent++];
+		op->fn = batch_done;
+		op->once = dev->burst;
+		req_send(dev, op);
+	}
+	while (dev->burst && dev->sent < dev->n && dev->npend < MAX_PENDING);
+}
+
+static void batch_done(struct dev *dev, struct op *op)
+{
+	if (--dev->left > 0 && dev->sent < dev->n && (dev->burst || dev->npend == 0))
+		batch_send(dev);
+}
+
+#ifndef LIBREVOCO
+static void batch_start(struct dev *dev, struct op *ops, int n, int burst)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		ops[i].state = ops[i].tries = 0;
+	dev->ops = ops;
+	dev->n = n;
+	dev->sent = 0;
+	dev->left = n;
+	dev->burst = burst;
+
+	if (n == 0)
+		return;
+	dev_drain(dev);
+	batch_send(dev);
+}
+#endif
+
+static void batch_stop(struct dev *dev)
+{
+	dev->left = 0;
+	req_clear(dev);
+}
+
+/*
+ * Answers are for a request in flight, HID++ 1.0 notifications have a
+ * sub-id below 0x80.  HID++ 2.0 answers do too, but they carry our
+ * software id.
+ */
+static void dev_frame(struct dev *dev, const int *buf)
+{
+	if (!req_frame(dev, buf) && buf[1] < 0x80)
+		notification(dev, buf);
+}
+
+/*
+ * The HID++ reports are arrays with a single usage, so the per-usage
+ * events of hiddev are useless.  But with HIDDEV_FLAG_REPORT we get one
+ * event per received report and the field values still hold its data.
+ * They only hold the latest one though, so of several reports read in
+ * one go only the last can be looked at.
+ */
+static void hiddev_input(struct watch *w)
+{
+	struct dev *dev = w->data;
+	struct hiddev_usage_ref ev[64];
+	int i, n, report, buf[6];
+
+	while ((n = read(dev->fd, ev, sizeof(ev))) > 0)
+	{
+		dev->seen = 1;
+		n /= sizeof(*ev);
+		report = 0;
+		for (i = 0; i < n; ++i)
+			if (dev->event)
+				dev->event(dev, &ev[i]);
+			else if (ev[i].field_index == HID_FIELD_INDEX_NONE &&
+			         ev[i].report_type == HID_REPORT_TYPE_INPUT &&
+			         (ev[i].report_id == 0x10 || ev[i].report_id == 0x11))
+				report = ev[i].report_id;
+			else if (tuning)
+				tune_event(dev, &ev[i]);
+
+		/* of a long report only the head is looked at */
+		if (report && get_usages(dev->fd, HID_REPORT_TYPE_INPUT, report, buf, 6) == 0)
+			dev_frame(dev, buf);
+	}
+
+	/* gone, the next ioctl will tell */
+	if (n == 0 || (errno != EAGAIN && errno != EINTR))
+	{
+		ev_del(&dev->in);
+		batch_stop(dev);
+	}
+}
+
+/*
+ * hidraw hands out whole reports, one per read().  For dump they are
+ * turned into what hiddev would have said about them.
+ */
+static void raw_report(struct dev *dev, const unsigned char *r, int n)
+{
+	struct hiddev_usage_ref uref;
+	int i, buf[6];
+
+	dev->seen = 1;
+	if (dev->event)
+	{
+		memset(&uref, 0, sizeof(uref));
+		uref.report_type = HID_REPORT_TYPE_INPUT;
+		uref.report_id = r[0];
+		for (i = 1; i < n; ++i)
+		{
+			uref.usage_index = i - 1;
+			uref.value = r[i];
+			dev->event(dev, &uref);
+		}
+		uref.field_index = HID_FIELD_INDEX_NONE;
+		uref.usage_index = uref.value = 0;
+		dev->event(dev, &uref);
+	}
+	else if ((r[0] == 0x10 && n >= 7) || (r[0] == 0x11 && n >= 20))
+	{
+		for (i = 0; i < 6; ++i)
+			buf[i] = r[i + 1];
+		dev_frame(dev, buf);
+	}
+}
+
+static void hiddev_setup(struct dev *dev)
+{
+	int flag = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+
+	if (ioctl(dev->fd, HIDIOCSFLAG, &flag) == -1)
+		warn("HIDIOCSFLAG: %s", strerror(errno));
+}
+
+static void hidraw_input(struct watch *w)
+{
+	struct dev *dev = w->data;
+	unsigned char r[64];
+	int n;
+
+	while ((n = read(dev->fd, r, sizeof(r))) > 0)
+		raw_report(dev, r, n);
+
+	if (n == 0 || (errno != EAGAIN && errno != EINTR))
+	{
+		ev_del(&dev->in);
+		batch_stop(dev);
+	}
+}
+
+static void dev_timeout(struct watch *w)
+{
+	struct dev *dev = w->data;
+	unsigned long long n;
+
+	if (read(w->fd, &n, sizeof(n)) == sizeof(n) && dev->npend)
+		req_timeout(dev);
+}
+
+/*** captures ***/
+
+/*
+ * dump with --capture=file writes a header naming the receiver and a
+ * fixed size record per hiddev event, stamped in us since the capture
+ * started.  --decode prints a capture, --replay feeds it to the mock.
+ * Both map the file rather than read it, captures can be hours long.
+ */
+#define CAP_MAGIC	"revocap"
+#define CAP_VERSION	1
+
+struct cap_head
+{
+	char magic[8];
+	unsigned int version, rec_size;
+	int vendor, product;
+	long long start;	// ms since the epoch
+	char path[64];
+};
+
+struct cap_rec
+{
+	long long usec;
+	struct hiddev_usage_ref uref;
+};
+
+/* returns the records, a torn one at the end is left out */
+static const struct cap_rec *cap_map(const char *name, const struct cap_head **head, int *n)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		fatal("%s: %s", name, strerror(errno));
+	if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(**head))
+		fatal("%s: not a revoco capture", name);
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		fatal("%s: %s", name, strerror(errno));
+	madvise(p, sb.st_size, MADV_SEQUENTIAL);
+
+	*head = p;
+	if (memcmp((*head)->magic, CAP_MAGIC, sizeof((*head)->magic)) ||
+	    (*head)->rec_size != sizeof(struct cap_rec))
+		fatal("%s: not a revoco capture", name);
+	if ((*head)->version != CAP_VERSION)
+		fatal("%s: capture version %u, not %d", name, (*head)->version, CAP_VERSION);
+	*n = (sb.st_size - sizeof(**head)) / sizeof(struct cap_rec);
+	return (const struct cap_rec *)(*head + 1);
+}
+
+/*** mock device ***/
+
+/*
+ * A simulated receiver, to measure revoco without a mouse.  It knows
+ * the wheel mode and the battery and answers each HID++ request
+ * `mock_delay' ms after it was sent.  Its fd is a timerfd that fires
+ * when the next answer is due.  With --replay the first one also sends
+ * the events of a capture, at their time divided by `replay_speed'.
+ */
+#define MOCK_QUEUE	64
+
+#define MOCK_PAIRED	0x06	// indexes 1 and 2
+#define MOCK_HIDPP2	2	// this one speaks HID++ 2.0 too
+
+static const int mock_features[][2] =
+{
+	{ 0x0000, 0 }, { 0x0001, 1 }, { 0x0003, 2 }, { 0x1000, 3 }, { 0x2110, 9 }
+};
+
+struct mock
+{
+	int click[8];		// per index
+	int flags[3];		// register 0x00, which notifications are on
+	int last[6];		// what the input report holds
+	int head, len;
+	struct { long long due; int buf[6]; } q[MOCK_QUEUE];
+
+	const struct cap_rec *rec, *rec_end;	// left to replay
+	long long rec_t0;	// ms
+	int rbuf[6];		// the replayed report so far
+};
+
+static struct mock mocks[MAX_DEVS];
+
+static void mock_script(struct mock *m, const int *req, int *ans)
+{
+	int i, *click = &m->click[req[0] & 7];
+
+	memcpy(ans, req, 6 * sizeof(*ans));
+
+	if (req[0] != 0xff && !(MOCK_PAIRED & 1 << (req[0] & 7)))
+	{
+		ans[1] = 0x8f;
+		ans[2] = req[1];
+		ans[3] = req[2];
+		ans[4] = 0x08;		// unknown device
+		ans[5] = 0;
+	}
+	else if (req[0] == MOCK_HIDPP2 && req[1] == 0x00 && (req[2] >> 4) == 0)
+	{
+		/* IRoot getFeature, index 0 if there is none */
+		for (i = 0; i < sizeof(mock_features) / sizeof(*mock_features); ++i)
+			if (mock_features[i][0] == (req[3] << 8 | req[4]))
+				break;
+		ans[3] = i < sizeof(mock_features) / sizeof(*mock_features) ? mock_features[i][1] : 0;
+		ans[4] = ans[5] = 0;
+	}
+	else if (req[0] == MOCK_HIDPP2 && req[1] < 0x80)
+	{
+		ans[1] = 0xff;
+		ans[2] = req[1];
+		ans[3] = req[2];
+		ans[4] = req[1] < 10 ? 0x07 : 0x06;	// invalid function/feature index
+		ans[5] = 0;
+	}
+	else if (req[1] == 0x80 && req[2] == 0x56)
+	{
+		if ((req[3] & 0x7f) == 1 || (req[3] & 0x7f) == 2)
+			*click = (req[3] & 0x7f) == 2;
+		ans[3] = ans[4] = ans[5] = 0;
+	}
+	else if (req[1] == 0x81 && req[2] == 0x08)
+		ans[3] = ans[4] = 0, ans[5] = *click;
+	else if (req[1] == 0x81 && req[2] == 0x0d)
+		ans[3] = 85, ans[4] = 0, ans[5] = 0x30;
+	else if (req[1] == 0x80 && req[2] == 0xb2)
+		ans[3] = ans[4] = ans[5] = 0;
+	else if (req[1] == 0x80 && req[2] == 0x00)
+	{
+		memcpy(m->flags, req + 3, sizeof(m->flags));
+		ans[3] = ans[4] = ans[5] = 0;
+	}
+	else if (req[1] == 0x81 && req[2] == 0x00)
+		memcpy(ans + 3, m->flags, sizeof(m->flags));
+	else if (req[1] == 0x83 && req[2] == 0xb5 && req[3] >= 0x20 && req[3] < 0x26 &&
+	         (MOCK_PAIRED & 1 << (req[3] - 0x1f)))
+		ans[4] = req[3] - 0x1f, ans[5] = 8;	// destination, report interval
+	else
+	{
+		ans[1] = 0x8f;
+		ans[2] = req[1];
+		ans[3] = req[2];
+		ans[4] = 0x02;		// invalid address
+		ans[5] = 0;
+	}
+}
+
+/* the answer at the head has arrived */
+static void mock_pop(struct mock *m)
+{
+	memcpy(m->last, m->q[m->head].buf, sizeof(m->last));
+	m->head = (m->head + 1) % MOCK_QUEUE;
+	m->len--;
+}
+
+static long long mock_rec_due(struct mock *m)
+{
+	return m->rec_t0 + (replay_speed ? m->rec->usec / 1000 / replay_speed : 0);
+}
+
+static void mock_arm(struct dev *dev)
+{
+	struct mock *m = dev->mock;
+	long long due = -1, left;
+
+	if (m->len)
+		due = m->q[m->head].due;
+	if (m->rec < m->rec_end && (due < 0 || mock_rec_due(m) < due))
+		due = mock_rec_due(m);
+	if (due >= 0)
+	{
+		left = due - now_ms();
+		timer_set(&dev->in, left > 0 ? left : 0);
+	}
+}
+
+/* a captured event: dump gets it as it was, reports are put together */
+static void mock_replay(struct dev *dev, const struct cap_rec *rec)
+{
+	struct hiddev_usage_ref uref = rec->uref;
+	struct mock *m = dev->mock;
+	unsigned char r[7];
+	int i;
+
+	dev->seen = 1;
+	if (dev->event)
+		dev->event(dev, &uref);
+	else if (tuning && uref.usage_code == HID_GD_WHEEL)
+		tune_event(dev, &uref);
+	else if (uref.field_index != HID_FIELD_INDEX_NONE)
+	{
+		if (uref.usage_index < 6)
+			m->rbuf[uref.usage_index] = uref.value & 0xff;
+	}
+	else if (uref.report_type == HID_REPORT_TYPE_INPUT &&
+	         (uref.report_id == 0x10 || uref.report_id == 0x11))
+	{
+		memcpy(m->last, m->rbuf, sizeof(m->last));
+		r[0] = 0x10;
+		for (i = 0; i < 6; ++i)
+			r[i + 1] = m->rbuf[i];
+		raw_report(dev, r, 7);
+	}
+}
+
+/* a Unifying receiver */
+static int mock_info(struct dev *dev)
+{
+	return set_model(dev, LOGITECH, MX_REVOLUTION4);
+}
+
+/* a replay starts with the first wakeup, before anything was sent */
+static void mock_setup(struct dev *dev)
+{
+	struct watch w;
+
+	w.fd = dev->fd;
+	if (dev->mock->rec < dev->mock->rec_end)
+		timer_set(&w, 0);
+}
+
+static void mock_write(struct dev *dev, int id, const int *buf, int n)
+{
+	struct mock *m = dev->mock;
+	int i, was = m->len, req[6] = { 0 };
+
+	/* a full queue loses requests like a busy receiver would */
+	if (id != 0x10 || m->len == MOCK_QUEUE)
+		return;
+	for (i = 0; i < n && i < 6; ++i)
+		req[i] = buf[i];
+
+	i = (m->head + m->len++) % MOCK_QUEUE;
+	m->q[i].due = now_ms() + mock_delay;
+	mock_script(m, req, m->q[i].buf);
+
+	/* switching battery notifications on reports the battery right away */
+	if (req[1] == 0x80 && req[2] == 0x00 && (req[3] & 0x10) && m->len < MOCK_QUEUE)
+	{
+		const int note[6] = { req[0], 0x0d, 85, 0, 0x30, 0 };
+
+		i = (m->head + m->len++) % MOCK_QUEUE;
+		m->q[i].due = now_ms() + mock_delay;
+		memcpy(m->q[i].buf, note, sizeof(note));
+	}
+	if (was == 0)
+		mock_arm(dev);
+}
+
+static void mock_query(struct dev *dev, int id, int *buf, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		buf[i] = id == 0x10 && i < 6 ? dev->mock->last[i] : 0;
+}
+
+static void mock_drain(struct dev *dev)
+{
+	struct mock *m = dev->mock;
+
+	while (m->len && m->q[m->head].due <= now_ms())
+		mock_pop(m);
+}
+
+static void mock_input(struct watch *w)
+{
+	struct dev *dev = w->data;
+	struct mock *m = dev->mock;
+	unsigned long long n;
+	unsigned char r[7];
+	int i, k;
+
+	if (read(w->fd, &n, sizeof(n)) != sizeof(n))
+		return;
+
+	/* in time order; a fast replay gets a turn of the loop now and then */
+	for (k = 0; k < 256; ++k)
+	{
+		int ans = m->len && m->q[m->head].due <= now_ms();
+		int rec = m->rec < m->rec_end && mock_rec_due(m) <= now_ms();
+
+		if (ans && (!rec || m->q[m->head].due <= mock_rec_due(m)))
+		{
+			mock_pop(m);
+			r[0] = 0x10;
+			for (i = 0; i < 6; ++i)
+				r[i + 1] = m->last[i];
+			raw_report(dev, r, 7);
+		}
+		else if (rec)
+			mock_replay(dev, m->rec++);
+		else
+			break;
+	}
+	mock_arm(dev);
+}
+
+static int mock_dev(struct dev *devs, int max)
+{
+	struct dev *dev;
+	int n;
+
+	for (n = 0; n < mock_ndev && n < max; ++n)
+	{
+		dev = &devs[n];
+		if ((dev->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			fatal("timerfd_create: %s", strerror(errno));
+		dev->tp = &mock_tp;
+		dev->mock = &mocks[n];
+		memset(dev->mock, 0, sizeof(*dev->mock));
+		mock_info(dev);
+		snprintf(dev->path, sizeof(dev->path), "mock%d", n);
+		if (n == 0 && replay_file)
+		{
+			const struct cap_head *head;
+			int nrec;
+
+			dev->mock->rec = cap_map(replay_file, &head, &nrec);
+			dev->mock->rec_end = dev->mock->rec + nrec;
+			dev->mock->rec_t0 = now_ms();
+			if (!set_model(dev, head->vendor, head->product))
+				fatal("%s: %04x:%04x is no receiver of ours", replay_file, head->vendor, head->product);
+		}
+	}
+	return n;
+}
+
+static const struct transport hiddev_tp =
+{
+	hiddev_info, hiddev_setup, hiddev_write, hiddev_query, fd_drain, hiddev_input
+};
+
+static const struct transport hidraw_tp =
+{
+	hidraw_info, NULL, hidraw_write, hidraw_query, fd_drain, hidraw_input
+};
+
+static const struct transport mock_tp =
+{
+	mock_info, mock_setup, mock_write, mock_query, mock_drain, mock_input
+};
+
+/*** sending and waiting ***/
+
+#ifndef LIBREVOCO
+/* wait up to `timeout' ms (-1 forever) for the device to send something */
+static void wait_report(struct dev *dev, int timeout)
+{
+	long long t = now_us(), deadline = timeout < 0 ? -1 : t / 1000 + timeout;
+
+	dev->seen = 0;
+	while (!dev->seen && ev_run(deadline))
+		;
+	span(T_WAIT, t, dev, dev->seen ? "event" : "nothing");
+}
+
+/*
+ * Returns 1 when the device acknowledged the HID++ request (answer in
+ * `ans'), -1 if it reported an error, and 0 on timeout.
+ */
+static int send_report(struct dev *dev, int id, const int *buf, int n, int *ans)
+{
+	struct op op;
+
+	if (id != 0x10 || n < 3)
+	{
+		dev_drain(dev);
+		write_report(dev, id, buf, n);
+		wait_report(dev, dev_rto(dev, 0));
+		return 0;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.type = OP_RAW;
+	op.n = n;
+	memcpy(op.buf, buf, n * sizeof(*buf));
+
+	batch_start(dev, &op, 1, 0);
+	while (dev->left)
+		ev_run(-1);
+
+	if (op.state == 1 || op.state == -1)
+	{
+		if (ans)
+			memcpy(ans, op.ans, sizeof(op.ans));
+		return op.state;
+	}
+	return 0;
+}
+#endif
+
+static void init_dev(struct dev *dev)
+{
+	int tfd;
+
+	if (fcntl(dev->fd, F_SETFL, O_RDWR | O_NONBLOCK) == -1)
+		warn("fcntl(O_NONBLOCK): %s", strerror(errno));
+	if (dev->tp->setup)
+		dev->tp->setup(dev);
+
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		fatal("timerfd_create: %s", strerror(errno));
+	ev_add(&dev->in, dev->fd, dev->tp->input, dev);
+	ev_add(&dev->timer, tfd, dev_timeout, dev);
+	dev->event = NULL;
+	dev->left = 0;
+	dev->srtt = dev->rttvar = 0;
+	dev->wheel_state = 0;
+	dev->paired = -1;
+	dev->nfeat = -1;
+	memset(dev->wpid, 0, sizeof(dev->wpid));
+	dev->hidpp1 = 0;
+	dev->slot = -1;
+	dev->poll_at = dev->poll_ms = dev->notified = 0;
+	dev->level = -1;
+	memset(&dev->tune, 0, sizeof(dev->tune));
+}
+
+#ifndef LIBREVOCO
+/* forget an aborted request */
+static void reset_dev(struct dev *dev)
+{
+	dev->event = NULL;
+	batch_stop(dev);
+}
+#endif
+
+static void close_dev(struct dev *dev)
+{
+	int tfd = dev->timer.fd;
+
+	ev_del(&dev->in);
+	ev_del(&dev->timer);
+	close(dev->fd);
+	close(tfd);
+}
+
+/*
+ * The discovery cache holds `path busnum devnum first_byte' of the last
+ * device found.  One HIDIOCGDEVINFO tells whether it is still the same
+ * device; devnum changes whenever it gets plugged in again.
+ */
+static int cached_dev(struct dev *dev)
+{
+	struct hiddev_devinfo dinfo;
+	char name[512], path[256];
+	unsigned int bus, devnum;
+	int fb, n;
+	FILE *f;
+
+	if (!runtime_file(name, sizeof(name), "cache") || (f = fopen(name, "r")) == NULL)
+		return 0;
+	n = fscanf(f, "%255s %u %u %d", path, &bus, &devnum, &fb);
+	fclose(f);
+	dev->tp = &hiddev_tp;
+	if (n != 4 || (dev->fd = open(path, O_RDWR)) == -1)
+		return 0;
+
+	if (ioctl(dev->fd, HIDIOCGDEVINFO, &dinfo) == 0 &&
+	    dinfo.busnum == bus && dinfo.devnum == devnum &&
+	    set_model(dev, dinfo.vendor & 0xffff, dinfo.product & 0xffff))
+	{
+		dev->first_byte = fb;
+		strcpy(dev->path, path);
+		return 1;
+	}
+	close(dev->fd);
+	return 0;
+}
+
+static void cache_dev(struct dev *dev)
+{
+	struct hiddev_devinfo dinfo;
+	char name[512], tmp[520];
+	FILE *f;
+
+	if (ioctl(dev->fd, HIDIOCGDEVINFO, &dinfo) == -1)
+		return;
+
+	if (!runtime_file(name, sizeof(name), "cache") ||
+	    (f = tmp_file(name, tmp, sizeof(tmp))) == NULL)
+		return;
+	fprintf(f, "%s %u %u %d\n", dev->path, dinfo.busnum, dinfo.devnum, dev->first_byte);
+	if (fclose(f) != 0 || rename(tmp, name) == -1)
+		unlink(tmp);
+}
+
+/*
+ * Opens up to `max' devices; the cache only knows about a single hiddev
+ * one.  hidraw is used when asked for or when there is no hiddev.
+ */
+static int scan_devs(struct dev *devs, int max)
+{
+	long long t = now_us();
+	const char *how = "cache";
+	int n = 0;
+
+	if (mock_ndev)
+		n = mock_dev(devs, max), how = "mock";
+	else if (use_hidraw)
+		n = hidraw_dev(devs, max), how = "hidraw";
+	else if (max == 1 && cached_dev(devs))
+		n = 1;
+	else
+	{
+		how = "sysfs";
+		if ((n = sysfs_dev(devs, max)) == -2)
+		{
+			how = "probe";
+			n = open_dev("/dev/usb/hiddev%d", devs, max);
+			if (n == 0)
+				n = open_dev("/dev/hiddev%d", devs, max);
+		}
+		if (n == 1)
+			cache_dev(devs);
+		else if (n == 0)
+			n = hidraw_dev(devs, max), how = "hidraw";
+	}
+	span(T_FIND, t, NULL, "%s, %d found", how, n);
+	return n;
+}
+
+#ifndef LIBREVOCO
+static int find_devs(struct dev *devs, int max)
+{
+	long long t;
+	int i, n = scan_devs(devs, max);
+
+	for (i = 0; i < n; ++i)
+	{
+		t = now_us();
+		init_dev(&devs[i]);
+		span(T_INIT, t, NULL, "%s", devs[i].path);
+	}
+	if (status)
+		status_devs(devs, n);
+	if (monitor_max)
+		monitor_due(now_ms());
+	return n;
+}
+
+static void mx_cmd(struct dev *dev, int ix, int b1, int b2, int b3)
+{
+	int buf[6] = { ix, 0x80, 0x56, b1, b2, b3 };
+
+	send_report(dev, 0x10, buf, 6, 0);
+}
+
+/* a get-register answer from a device behind the receiver, to a register we read */
+static int valid_answer(const int *res)
+{
+	return res[0] >= 1 && res[0] <= MAX_INDEX && res[1] == 0x81 &&
+	       (res[2] == 0x08 || res[2] == 0x0d || res[2] == 0xb1);
+}
+
+static int check_answer(const int *res)
+{
+	int i;
+
+	if (!valid_answer(res))
+	{
+		printf("bad answer:");
+		for (i = 0; i < 6; ++i)
+		{
+		  printf("%02X ", res[i]);
+		}
+		printf("\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int mx_query(struct dev *dev, int ix, int b1, int *res)
+{
+	int buf[6] = { ix, 0x81, b1, 0, 0, 0 };
+	int i;
+
+	/* a lost answer is looked up with HIDIOCGREPORT, a bad one asked for again */
+	for (i = 0; i < MAX_TRIES; ++i)
+	{
+		res[0] = -1;
+		send_report(dev, 0x10, buf, 6, res);
+		if (valid_answer(res))
+			return 1;
+		if (i < MAX_TRIES - 1)
+			pause_ms(dev_rto(dev, i));
+	}
+	return 0;
+}
+
+/*
+ * A Unifying receiver pairs up to six devices, their frames start with
+ * the index 1-6.  Its pairing registers (long register 0xb5, 0x20 +
+ * index - 1) tell which are in use; all six are asked at once.
+ */
+static int dev_pairs(struct dev *dev)
+{
+	struct op ops[MAX_INDEX];
+	int i;
+
+	if (dev->paired >= 0)
+		return dev->paired;
+	if (!(dev->model->quirks & Q_UNIFYING))
+		return dev->paired = 1 << dev->first_byte;
+
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < MAX_INDEX; ++i)
+	{
+		int req[6] = { 0xff, 0x83, 0xb5, 0x20 + i, 0, 0 };
+
+		ops[i].type = OP_RAW;
+		ops[i].n = 6;
+		memcpy(ops[i].buf, req, sizeof(req));
+	}
+	batch_start(dev, ops, MAX_INDEX, 1);
+	while (dev->left)
+		ev_run(-1);
+
+	dev->paired = 0;
+	for (i = 0; i < MAX_INDEX; ++i)
+	{
+		/* lost in the burst */
+		if (ops[i].state == 0)
+			ops[i].state = send_report(dev, 0x10, ops[i].buf, 6, ops[i].ans);
+		if (ops[i].state == 1)
+			dev->paired |= 1 << (i + 1);
+	}
+	return dev->paired;
+}
+
+/* the indexes commands go to: --index, or the receiver's own */
+static void dev_targets(struct dev *dev)
+{
+	int i, p;
+
+	dev->nidx = 0;
+	if (index_all)
+	{
+		p = dev_pairs(dev);
+		for (i = 1; i <= MAX_INDEX; ++i)
+			if (p & 1 << i)
+				dev->idx[dev->nidx++] = i;
+		if (dev->nidx == 0)
+			fatal("%s: nothing paired", dev->path);
+	}
+	else if (nindex)
+		memcpy(dev->idx, index_list, (dev->nidx = nindex) * sizeof(*dev->idx));
+	else
+		dev->idx[dev->nidx++] = dev->first_byte;
+}
+
+/*
+ * The index of HID++ 2.0 feature `id' on device `ix': 0 if it has no
+ * such feature, -1 if it doesn't speak HID++ 2.0, -2 if it didn't say.
+ * Asking is IRoot (index 0) function 0, getFeature.
+ */
+#define SW_ID		0x0a	// ours, in the low nibble of HID++ 2.0 requests
+
+static int feature_index(struct dev *dev, int ix, int id)
+{
+	int i, r, req[6] = { ix, 0x00, 0x00 | SW_ID, id >> 8, id & 0xff, 0 }, ans[6];
+
+	if (id == 0x0000)
+		return 0;
+	if (dev->model->hidpp < 2)
+		return -1;
+	if (dev->nfeat < 0)
+		feature_load(dev);
+	for (i = 0; i < dev->nfeat; ++i)
+		if (dev->feat[i].ix == ix && dev->feat[i].id == id)
+		{
+			span(T_SKIP, now_us(), dev, "feature %04x of %d cached at %d", id, ix, dev->feat[i].index);
+			return dev->feat[i].index;
+		}
+
+	if ((r = send_report(dev, 0x10, req, 6, ans)) != 1)
+		return r == -1 ? -1 : -2;
+
+	/* not present is worth remembering too */
+	if (dev->nfeat < MAX_FEATURES)
+	{
+		dev->feat[dev->nfeat].ix = ix;
+		dev->feat[dev->nfeat].id = id;
+		dev->feat[dev->nfeat].index = ans[3];
+		dev->feat[dev->nfeat++].wpid = ix <= MAX_INDEX ? dev->wpid[ix] : 0;
+		feature_save(dev);
+	}
+	return ans[3];
+}
+
+/* with several devices, tell which one is talking; `ix' -1 for the receiver */
+static void print_dev(const struct dev *dev, int ix)
+{
+	if (all_devs)
+		printf("%s%s", dev->path, dev->nidx > 1 && ix >= 0 ? " " : ": ");
+	if (dev->nidx > 1 && ix >= 0)
+		printf("#%d: ", ix);
+}
+
+static void print_mode(const int *buf)
+{
+	if (buf[5] & 1)
+		printf("click-by-click\n");
+	else
+		printf("free spinning\n");
+}
+
+static void print_battery(const int *buf)
+{
+	char str[32], *st;
+
+	switch (buf[5])
+	{
+		case 0x30:	st = "running on battery";	break;
+		case 0x50:	st = "charging";		break;
+		case 0x90:	st = "fully charged";		break;
+		default:	sprintf(st = str, "status %02x", buf[5]);
+	}
+	printf("battery level %d%%, %s\n", buf[3], st);
+}
+
+static void json_str(const char *str)
+{
+	putchar('"');
+	for (; *str; ++str)
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < ' ')
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	putchar('"');
+}
+
+/*
+ * The answers of a `status' as one JSON object per line, null for what
+ * didn't come.  latency_ms is from the first request out to the last
+ * answer in.
+ */
+static void print_status(struct dev *dev, const struct op *mode, const struct op *bat)
+{
+	const char *charge;
+
+	printf("{\"device\":");
+	json_str(dev->path);
+	printf(",\"product\":\"%04x\",\"index\":%d,\"mode\":", dev->product, bat->buf[0]);
+	if (mode->state == 1 && valid_answer(mode->ans))
+		printf(mode->ans[5] & 1 ? "\"click\"" : "\"free\"");
+	else
+		printf("null");
+	if (bat->state == 1 && valid_answer(bat->ans))
+	{
+		switch (bat->ans[5])
+		{
+			case 0x30:	charge = "\"discharging\"";	break;
+			case 0x50:	charge = "\"charging\"";	break;
+			case 0x90:	charge = "\"full\"";		break;
+			default:	charge = "null";
+		}
+		printf(",\"battery\":%d,\"charge\":%s", bat->ans[3], charge);
+	}
+	else
+		printf(",\"battery\":null,\"charge\":null");
+	printf(",\"latency_ms\":%.3f}\n",
+	       ((bat->done > mode->done ? bat->done : mode->done) -
+	        (bat->sent < mode->sent ? bat->sent : mode->sent)) / 1000.0);
+}
+
+/* what the daemon last heard, without asking the device */
+static void snapshot(void)
+{
+	struct status st;
+	const struct status *p;
+	char name[512];
+	long long now = wall_ms();
+	unsigned int seq;
+	int fd, i, tries = 0, buf[6] = { 0 };
+
+	if (!runtime_file(name, sizeof(name), "status"))
+		fatal("no private runtime directory");
+	if ((fd = open(name, O_RDONLY)) == -1 ||
+	    (p = mmap(NULL, sizeof(st), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		fatal("no status from a daemon: %s", strerror(errno));
+	close(fd);
+
+	do
+	{
+		if (++tries > 100000)
+			fatal("status is stuck being written");
+		if ((seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE)) & 1)
+			continue;
+		memcpy(&st, p, sizeof(st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while ((seq & 1) || __atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq);
+	munmap((void *)p, sizeof(st));
+
+	if (st.magic != STATUS_MAGIC || st.ndev < 0 || st.ndev > MAX_DEVS)
+		fatal("%s: not a revoco status", name);
+	if (kill(st.pid, 0) == -1 && errno == ESRCH)
+		printf("daemon is gone, this is old news\n");
+
+	for (i = 0; i < st.ndev; ++i)
+	{
+		if (st.dev[i].battery >= 0)
+		{
+			printf("%.63s, %lld s ago: ", st.dev[i].path, (now - st.dev[i].battery_time) / 1000);
+			buf[3] = st.dev[i].battery, buf[5] = st.dev[i].charge;
+			print_battery(buf);
+		}
+		if (st.dev[i].click >= 0)
+		{
+			printf("%.63s, %lld s ago: ", st.dev[i].path, (now - st.dev[i].mode_time) / 1000);
+			buf[5] = st.dev[i].click;
+			print_mode(buf);
+		}
+		if (st.dev[i].battery < 0 && st.dev[i].click < 0)
+			printf("%s: nothing known yet\n", st.dev[i].path);
+	}
+}
+
+static char * onearg(char *str, char prefix, int *arg, int def, int min, int max)
+{
+	char *end;
+	long n;
+
+	*arg = def;
+
+	if (*str == '\0')
+		return str;
+
+	if (*str != prefix)
+		fatal("bad argument `%s': `%c' expected", str, prefix);
+
+	n = strtol(++str, &end, 0);
+	if (str != end)
+	{
+		*arg = n;
+		if (n < min || n > max)
+			fatal("argument `%.*s' out of range (%d-%d)", end - str, str, min, max);
+	}
+	return end;
+}
+
+/* `=n' seconds or `=nms', in ms */
+static int msarg(char *str, int def, int max)
+{
+	char *p;
+	int n;
+
+	p = onearg(str, '=', &n, def, 0, max * 1000);
+	if (strneq(p, "ms", 2))
+		p += 2;
+	else if (n > max)
+		fatal("argument `%s' out of range (0-%d)", str + 1, max);
+	else
+		n *= 1000;
+	if (*p)
+		fatal("malformed argument `%s'", str);
+	return n;
+}
+
+static void twoargs(char *str, int *arg1, int *arg2, int def, int min, int max)
+{
+	char *p = str;
+
+	p = onearg(p, '=', arg1, def, min, max);
+	p = onearg(p, ',', arg2, *arg1, min, max);
+	if (*p)
+		fatal("malformed argument `%s'", str);
+}
+
+static int nargs(char *str, int *buf, int n, int def, int min, int max)
+{
+	char *p = str;
+	int i = 0, del = '=';
+
+	while (n--)
+	{
+		if (*p)
+			i++;
+		p = onearg(p, del, buf++, def, min, max);
+		del = ',';
+	}
+	if (*p)
+		fatal("malformed argument `%s'", str);
+	return i;
+}
+
+/*** command list ***/
+
+static void hidpp_op(struct op *op, int type, int sub, int reg, int b1, int b2, int b3)
+{
+	op->type = type;
+	op->n = 6;
+	op->buf[0] = 0;
+	op->buf[1] = sub;
+	op->buf[2] = reg;
+	op->buf[3] = b1;
+	op->buf[4] = b2;
+	op->buf[5] = b3;
+}
+
+static void write_op(struct op *op, int b1, int b2, int b3)
+{
+	hidpp_op(op, OP_CMD, 0x80, 0x56, b1, b2, b3);
+}
+
+/* `ops' has room for two per argument */
+static int parse_args(int argc, char **argv, struct op *ops)
+{
+	int i, arg1, arg2;
+	struct op *op = ops;
+
+	for (i = 1; i < argc; ++i, ++op)
+	{
+		int perm = 0x80;
+		char *cmd = argv[i];
+
+		if (strneq(cmd, "temp-", 5))
+			perm = 0, cmd += 5;
+
+		if (streq(cmd, "free"))
+		{
+			write_op(op, perm + 1, 0, 0);
+		}
+		else if (streq(cmd, "click"))
+		{
+			write_op(op, perm + 2, 0, 0);
+		}
+		else if (strneq(cmd, "manual", 6))
+		{
+			twoargs(cmd + 6, &arg1, &arg2, 0, 0, 15);
+			if (arg1 != arg2)
+				write_op(op, perm + 7, arg1 * 16 + arg2, 0);
+			else
+				write_op(op, perm + 8, arg1, 0);
+		}
+		else if (strneq(cmd, "tune", 4) || strneq(cmd, "auto-tune", 9))
+		{
+			int set = *cmd == 'a';
+
+			if (*onearg(cmd + (set ? 9 : 4), '=', &arg1, 60, 1, 24*60*60))
+				fatal("malformed argument `%s'", argv[i]);
+			op->type = OP_TUNE;
+			op->arg1 = arg1;
+			op->arg2 = set ? perm + 5 : 0;
+		}
+		else if (strneq(cmd, "auto", 4))
+		{
+			twoargs(cmd + 4, &arg1, &arg2, 0, 0, 50);
+			write_op(op, perm + 5, arg1, arg2);
+		}
+		else if (strneq(argv[i], "soft-free", 9))
+		{
+			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
+			write_op(op, 3, arg1, arg2);
+		}
+		else if (strneq(argv[i], "soft-click", 10))
+		{
+			twoargs(argv[i] + 10, &arg1, &arg2, 0, 0, 255);
+			write_op(op, 4, arg1, arg2);
+		}
+		else if (strneq(argv[i], "reconnect", 9))
+		{
+			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
+			op->type = OP_RECONNECT;
+		}
+		else if (strneq(argv[i], "mode", 4))
+			hidpp_op(op, OP_MODE, 0x81, 0x08, 0, 0, 0);
+		else if (strneq(argv[i], "battery", 7))
+			hidpp_op(op, OP_BATTERY, 0x81, 0x0d, 0, 0, 0);
+		else if (streq(argv[i], "status"))
+		{
+			/* both go out together, the second prints them */
+			hidpp_op(op, OP_STATUS, 0x81, 0x08, 0, 0, 0);
+			hidpp_op(++op, OP_STATUS, 0x81, 0x0d, 0, 0, 0);
+		}
+
+		/*** debug commands ***/
+		else if (strneq(argv[i], "raw", 3))
+		{
+			op->type = OP_RAW;
+			op->n = nargs(argv[i] + 3, op->buf, 256, 0, 0, 255);
+		}
+		else if (strneq(argv[i], "query", 5))
+		{
+			twoargs(argv[i] + 5, &arg1, &arg2, -1, 0, 255);
+			if (arg1 == -1)
+				arg1 = 0x10, arg2 = 6;
+			op->type = OP_QUERY;
+			op->arg1 = arg1, op->arg2 = arg2;
+		}
+		else if (strneq(argv[i], "dump", 4))
+		{
+			arg1 = streq(cmd + 4, "=-1") ? -1 : msarg(cmd + 4, 3, 24*60*60);
+			op->type = OP_DUMP;
+			op->arg1 = arg1;
+		}
+		else if (strneq(argv[i], "bench", 5))
+		{
+			char *p = onearg(argv[i] + 5, '=', &arg1, 100, 1, 100000);
+
+			if (*onearg(p, ',', &arg2, 10, 0, 100000))
+				fatal("malformed argument `%s'", argv[i]);
+			op->type = OP_BENCH;
+			op->arg1 = arg1, op->arg2 = arg2;
+		}
+		else if (strneq(argv[i], "feature=", 8))
+		{
+			if (*onearg(argv[i] + 7, '=', &arg1, 0, 0, 0xffff))
+				fatal("malformed argument `%s'", argv[i]);
+			op->type = OP_FEATURE;
+			op->arg1 = arg1;
+		}
+		else if (strneq(argv[i], "sleep", 5))
+		{
+			op->type = OP_SLEEP;
+			op->arg1 = msarg(argv[i] + 5, 1, 255);
+		}
+
+		/*** sequences ***/
+		else if (strneq(argv[i], "wait=", 5) || strneq(argv[i], "at=", 3))
+		{
+			op->type = *argv[i] == 'w' ? OP_WAIT : OP_AT;
+			if (*onearg(strchr(argv[i], '='), '=', &arg1, 0, 0, 24*60*60*1000))
+				fatal("malformed argument `%s'", argv[i]);
+			op->arg1 = arg1;
+		}
+		else if (strneq(argv[i], "repeat=", 7))
+		{
+			if (*onearg(argv[i] + 6, '=', &arg1, 1, 1, 1000000000))
+				fatal("malformed argument `%s'", argv[i]);
+			op->type = OP_REPEAT;
+			op->arg1 = arg1;
+		}
+		else
+			fatal("unknown option `%s'", argv[i]);
+	}
+	return op - ops;
+}
+
+/*** dump output ***/
+
+/*
+ * While the wheel spins events come in faster than printf() likes, so
+ * dump formats by hand into a big buffer that is written out once per
+ * wakeup.
+ */
+static char out_buf[1 << 16];
+static int out_len, out_fd = 1;	// out_fd is the capture's while there is one
+static long long cap_t0;
+
+static void out_flush(void)
+{
+	char *p = out_buf;
+	int n;
+
+	while (out_len > 0 && (n = write(out_fd, p, out_len)) > 0)
+		p += n, out_len -= n;
+	out_len = 0;
+}
+
+static void put(const void *p, int n)
+{
+	if (out_len + n > sizeof(out_buf))
+		out_flush();
+	memcpy(out_buf + out_len, p, n);
+	out_len += n;
+}
+
+static void put_str(const char *str)
+{
+	put(str, strlen(str));
+}
+
+static void put_hex(unsigned int v)
+{
+	char buf[8];
+	int i;
+
+	for (i = 7; i >= 0; --i, v >>= 4)
+		buf[i] = "0123456789abcdef"[v & 15];
+	put(buf, 8);
+}
+
+static void put_dec(unsigned int v)
+{
+	char buf[10];
+	int i = sizeof(buf);
+
+	do
+		buf[--i] = '0' + v % 10;
+	while (v /= 10);
+	put(buf + i, sizeof(buf) - i);
+}
+
+static void put_uref(const struct hiddev_usage_ref *uref)
+{
+	put_str("read: type=");
+	put_dec(uref->report_type);
+	put_str(", id=");
+	put_dec(uref->report_id);
+	put_str(", field=");
+	put_hex(uref->field_index);
+	put_str(", usage=");
+	put_hex(uref->usage_index);
+	put_str(", code=");
+	put_hex(uref->usage_code);
+	put_str(", value=");
+	put_dec(uref->value);
+	put_str("\n");
+}
+
+/*
+ * --filter=id=n,code=n,id!=n...: events of other reports and usages are
+ * dropped before anything is done with them.  Of several `=' terms on a
+ * field one must match, all `!=' terms must.  `hidpp' is short for
+ * id=0x10,id=0x11.  Reports end with an event without a usage, the code
+ * terms leave those alone.
+ */
+#define MAX_TERMS	8
+
+struct terms
+{
+	int n, v[MAX_TERMS];	// one of them
+	int nx, x[MAX_TERMS];	// none of them
+};
+
+static struct filter
+{
+	int on;
+	struct terms id, code;
+} filter;
+
+static void add_term(int *n, int *v, unsigned int val)
+{
+	if (*n == MAX_TERMS)
+		fatal("too many filter terms");
+	v[(*n)++] = val;
+}
+
+static void parse_filter(char *expr)
+{
+	struct terms *t;
+	char *p, *q, *term;
+	unsigned int val;
+	int not;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.on = 1;
+	for (term = strtok(expr, ","); term; term = strtok(NULL, ","))
+	{
+		if (streq(term, "hidpp"))
+		{
+			add_term(&filter.id.n, filter.id.v, 0x10);
+			add_term(&filter.id.n, filter.id.v, 0x11);
+			continue;
+		}
+		if (strneq(term, "id", 2))
+			p = term + 2, t = &filter.id;
+		else if (strneq(term, "code", 4))
+			p = term + 4, t = &filter.code;
+		else
+			fatal("bad filter term `%s'", term);
+
+		not = strneq(p, "!=", 2);
+		if (*p != '=' && !not)
+			fatal("bad filter term `%s'", term);
+		val = strtoul(q = p + 1 + not, &p, 0);
+		if (p == q || *p)
+			fatal("bad filter term `%s'", term);
+		if (not)
+			add_term(&t->nx, t->x, val);
+		else
+			add_term(&t->n, t->v, val);
+	}
+}
+
+static int one_of(const int *v, int n, unsigned int val)
+{
+	while (n--)
+		if (v[n] == val)
+			return 1;
+	return 0;
+}
+
+static int filter_match(const struct hiddev_usage_ref *uref)
+{
+	if (!filter.on)
+		return 1;
+	if ((filter.id.n && !one_of(filter.id.v, filter.id.n, uref->report_id)) ||
+	    one_of(filter.id.x, filter.id.nx, uref->report_id))
+		return 0;
+	if (uref->field_index == HID_FIELD_INDEX_NONE)
+		return 1;
+	return !(filter.code.n && !one_of(filter.code.v, filter.code.n, uref->usage_code)) &&
+	       !one_of(filter.code.x, filter.code.nx, uref->usage_code);
+}
+
+/* the HID++ message as one line */
+static void put_hidpp(const int *buf)
+{
+	static const char *status[16] = { [3] = "running on battery", [5] = "charging", [9] = "fully charged" };
+	int i;
+
+	put_str("hid++");
+	for (i = 0; i < 6; ++i)
+	{
+		put(" ", 1);
+		put("0123456789abcdef" + (buf[i] >> 4 & 15), 1);
+		put("0123456789abcdef" + (buf[i] & 15), 1);
+	}
+	put_str("  ");
+	if (buf[1] == 0x8f)
+		put_str("error "), put_dec(buf[4]);
+	else if (buf[1] >= 0x80)
+		put_str("answer");
+	else if (buf[1] == 0x0d)
+	{
+		put_str("battery "), put_dec(buf[2]), put_str("%");
+		if ((buf[4] & 15) == 0 && status[buf[4] >> 4])
+			put_str(", "), put_str(status[buf[4] >> 4]);
+	}
+	else if (buf[1] == 0x41)
+		put_str(buf[3] & 0x40 ? "link lost" : "link established");
+	else if (buf[1] == 0x40)
+		put_str("unpaired");
+	else
+		put_str("notification");
+	put_str("\n");
+}
+
+static void put_usec(long long usec)
+{
+	char buf[8];
+	int i, v = usec % 1000000;
+
+	put_dec(usec / 1000000);
+	buf[0] = '.';
+	for (i = 6; i > 0; --i, v /= 10)
+		buf[i] = '0' + v % 10;
+	buf[7] = ' ';
+	put(buf, 8);
+}
+
+static void dump_out(struct dev *dev, const struct hiddev_usage_ref *uref)
+{
+	struct cap_rec rec;
+
+	if (out_fd != 1)
+	{
+		rec.usec = now_us() - cap_t0;
+		rec.uref = *uref;
+		put(&rec, sizeof(rec));
+		return;
+	}
+	if (binary)
+	{
+		put(uref, sizeof(*uref));
+		return;
+	}
+
+	if (all_devs)
+		put_str(dev->path), put_str(": ");
+	put_uref(uref);
+}
+
+/*
+ * The usages of reports 0x10 and 0x11 are put together for the HID++
+ * message.  hiddev may only tell that a report came, then the message is
+ * asked for and its usages made up, so a capture has them anyway.  With
+ * a filter the message is printed as one line instead of its usages.
+ * `dev' is NULL and `usec' the time when decoding a capture.
+ */
+static int frame[6], frame_seen;
+
+static void dump_uref(struct dev *dev, const struct hiddev_usage_ref *uref, long long usec)
+{
+	struct hiddev_usage_ref u;
+	int i, one = filter.on && !binary && out_fd == 1;
+
+	if (!filter_match(uref))
+		return;
+	if (uref->report_type == HID_REPORT_TYPE_INPUT &&
+	    (uref->report_id == 0x10 || uref->report_id == 0x11))
+	{
+		if (uref->field_index != HID_FIELD_INDEX_NONE)
+		{
+			if (uref->usage_index < 6)
+				frame[uref->usage_index] = uref->value & 0xff, frame_seen = 1;
+			if (one)
+				return;
+		}
+		else
+		{
+			if (!frame_seen && dev)
+			{
+				dev->tp->query(dev, uref->report_id, frame, 6);
+				for (i = 0; i < 6 && !one; ++i)
+				{
+					u = *uref;
+					u.field_index = 0;
+					u.usage_index = i;
+					u.value = frame[i];
+					dump_out(dev, &u);
+				}
+			}
+			frame_seen = 0;
+			if (one)
+			{
+				if (usec >= 0)
+					put_usec(usec);
+				if (dev && all_devs)
+					put_str(dev->path), put_str(": ");
+				put_hidpp(frame);
+				return;
+			}
+		}
+	}
+	if (usec >= 0)
+		put_usec(usec);
+	if (dev)
+		dump_out(dev, uref);
+	else
+		put_uref(uref);
+}
+
+static void dump_event(struct dev *dev, struct hiddev_usage_ref *uref)
+{
+	dump_uref(dev, uref, -1);
+}
+
+static void cap_begin(struct dev *dev)
+{
+	struct cap_head head;
+	int fd;
+
+	if ((fd = open(capture_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		fatal("%s: %s", capture_file, strerror(errno));
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, CAP_MAGIC, sizeof(head.magic));
+	head.version = CAP_VERSION;
+	head.rec_size = sizeof(struct cap_rec);
+	head.vendor = LOGITECH;
+	head.product = dev->product;
+	head.start = wall_ms();
+	strncpy(head.path, dev->path, sizeof(head.path) - 1);
+
+	out_flush();
+	out_fd = fd;
+	cap_t0 = now_us();
+	put(&head, sizeof(head));
+}
+
+/* returns the bytes written */
+static long long cap_close(void)
+{
+	long long n;
+
+	out_flush();
+	n = lseek(out_fd, 0, SEEK_CUR);
+	close(out_fd);
+	out_fd = 1;
+	return n;
+}
+
+static void cap_end(void)
+{
+	long long n = cap_close();
+
+	printf("%s: %lld events\n", capture_file, n > 0 ? (n - (long long)sizeof(struct cap_head)) / (long long)sizeof(struct cap_rec) : 0);
+}
+
+/*
+ * Until nothing comes in for `ms'.  A fatal() in between closes the
+ * capture, or the daemon's next output would still go there.
+ */
+static void dump(struct dev *dev, int ms)
+{
+	jmp_buf jb, *old = fatal_jmp;
+
+	fflush(stdout);
+	if (capture_file)
+		cap_begin(dev);
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		dev->event = NULL;
+		if (out_fd != 1)
+			cap_close();
+		quit(fatal_status);
+	}
+	fatal_jmp = &jb;
+	dev->event = dump_event;
+	do
+	{
+		wait_report(dev, ms);
+		out_flush();
+	}
+	while (dev->seen);
+	dev->event = NULL;
+	fatal_jmp = old;
+	if (capture_file)
+		cap_end();
+}
+
+/* prints a capture the way dump would have, with the time of each event */
+static void decode(const char *name)
+{
+	const struct cap_head *head;
+	const struct cap_rec *rec;
+	char when[64];
+	time_t t;
+	int i, n;
+
+	rec = cap_map(name, &head, &n);
+	t = head->start / 1000;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("%04x:%04x %.64s, %s, %d events\n", head->vendor, head->product, head->path, when, n);
+	fflush(stdout);
+
+	for (i = 0; i < n; ++i)
+		dump_uref(NULL, &rec[i].uref, rec[i].usec);
+	out_flush();
+}
+#endif
+
+/*** wheel tuning ***/
+
+/*
+ * How fast the wheel turns, to pick the speeds of `auto='.  The clicks
+ * of each direction are counted over TUNE_WINDOW ms from the first one
+ * on and go into a histogram of such windows.  That's constant memory,
+ * old windows count half whenever one direction has a million.  The
+ * speed suggested is the one 95% of the windows stay below, so only
+ * the fastest spins switch to free spinning.
+ */
+#define TUNE_MIN		20		// windows needed for a suggestion
+
+static void tune_close(struct tune *t)
+{
+	int d, b;
+
+	for (d = 0; d < 2; ++d)
+		if (t->sum[d])
+		{
+			t->hist[d][t->sum[d] < TUNE_BINS ? t->sum[d] : TUNE_BINS - 1]++;
+			t->sum[d] = 0;
+			if (++t->n[d] == 1 << 20)
+				for (t->n[d] = b = 0; b < TUNE_BINS; ++b)
+					t->n[d] += t->hist[d][b] /= 2;
+		}
+}
+
+static void tune_add(struct tune *t, long long now, int clicks)
+{
+	if (now >= t->t + TUNE_WINDOW)
+	{
+		tune_close(t);
+		t->t = now;
+	}
+	t->sum[clicks < 0] += abs(clicks);
+}
+
+static void tune_event(struct dev *dev, struct hiddev_usage_ref *uref)
+{
+	if (uref->usage_code == HID_GD_WHEEL && uref->field_index != HID_FIELD_INDEX_NONE &&
+	    uref->value != 0)
+		tune_add(&dev->tune, now_ms(), (int)uref->value);
+}
+
+#ifndef LIBREVOCO
+/* the clicks per window `percent' % of direction `d' stay at or below */
+static int tune_pick(const struct tune *t, int d, int percent)
+{
+	unsigned int sum = 0;
+	int b;
+
+	if (t->n[d] == 0)
+		return 0;
+	for (b = 0; b < TUNE_BINS - 1; ++b)
+		if ((sum += t->hist[d][b]) * 100ULL >= (unsigned long long)t->n[d] * percent)
+			break;
+	return b;
+}
+
+/*
+ * Samples for `secs' unless the daemon has been tuning all along, then
+ * suggests auto=up,down and sends it if `b1' (the mode byte) is set.
+ */
+static void tune(struct dev *dev, int secs, int b1)
+{
+	struct tune *t = &dev->tune;
+	int d, j, speed[2];
+
+	if (dev->tp == &hidraw_tp)
+		fatal("%s: the wheel doesn't show on hidraw, tuning needs hiddev", dev->path);
+	if (!tuning || t->n[0] + t->n[1] < TUNE_MIN)
+	{
+		memset(t, 0, sizeof(*t));
+		print_dev(dev, -1);
+		printf("scroll for %d seconds...\n", secs);
+		fflush(stdout);
+		dev->event = tune_event;
+		pause_ms(secs * 1000);
+		dev->event = NULL;
+	}
+	tune_close(t);
+
+	for (d = 0; d < 2; ++d)
+	{
+		print_dev(dev, -1);
+		printf("%-4s %6u windows of %d ms, clicks: median %d, 95%% %d, max %d\n",
+		       d ? "down" : "up", t->n[d], TUNE_WINDOW, tune_pick(t, d, 50),
+		       tune_pick(t, d, 95), tune_pick(t, d, 100));
+		/* auto= takes clicks per second */
+		speed[d] = (tune_pick(t, d, 95) + 1) * 1000 / TUNE_WINDOW;
+		if (speed[d] > 50)
+			speed[d] = 50;
+	}
+
+	print_dev(dev, -1);
+	if (t->n[0] < TUNE_MIN || t->n[1] < TUNE_MIN)
+	{
+		printf("not enough scrolling to tune, %d windows each needed\n", TUNE_MIN);
+		return;
+	}
+	printf("suggested auto=%d,%d\n", speed[0], speed[1]);
+	if (b1)
+		for (j = 0; j < dev->nidx; ++j)
+			mx_cmd(dev, dev->idx[j], b1, speed[0], speed[1]);
+}
+
+/*** benchmark ***/
+
+#define BENCH_WINDOW	8
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * `n' mode and battery queries in turns, `window' of them at a time.
+ * Stores the round trips in `lat' (us) and returns how many came back.
+ */
+static int bench_run(struct dev *dev, int n, int window, int *lat)
+{
+	struct op ops[BENCH_WINDOW];
+	int i, j, k, m = 0;
+
+	for (i = 0; i < n; i += k)
+	{
+		k = n - i < window ? n - i : window;
+		memset(ops, 0, sizeof(ops));
+		for (j = 0; j < k; ++j)
+		{
+			hidpp_op(&ops[j], OP_MODE, 0x81, (i + j) & 1 ? 0x0d : 0x08, 0, 0, 0);
+			ops[j].buf[0] = dev->first_byte;
+		}
+
+		batch_start(dev, ops, k, window > 1);
+		while (dev->left)
+			ev_run(-1);
+
+		for (j = 0; j < k; ++j)
+			if (ops[j].state == 1 || ops[j].state == -1)
+				lat[m++] = ops[j].done - ops[j].sent;
+	}
+	return m;
+}
+
+/* percentile by nearest rank, in ms */
+static double pct(const int *lat, int n, int p)
+{
+	int i = (p * n + 99) / 100 - 1;
+
+	return n ? lat[i < 0 ? 0 : i] / 1000.0 : 0;
+}
+
+/* one line of key=value pairs per run, to be compared across releases */
+static void bench(struct dev *dev, int n, int warmup)
+{
+	static const char *name[] = { "serial", "pipelined" };
+	jmp_buf jb, *old = fatal_jmp;
+	long long t;
+	int *lat, i, m;
+
+	if ((lat = malloc((n > warmup ? n : warmup) * sizeof(*lat))) == NULL)
+		fatal("out of memory");
+	/* the daemon goes on after a fatal(), so don't leak it */
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		free(lat);
+		quit(fatal_status);
+	}
+	fatal_jmp = &jb;
+
+	bench_run(dev, warmup, 1, lat);
+	for (i = 0; i < 2; ++i)
+	{
+		t = now_us();
+		m = bench_run(dev, n, i ? BENCH_WINDOW : 1, lat);
+		t = now_us() - t;
+		qsort(lat, m, sizeof(*lat), cmp_int);
+
+		print_dev(dev, -1);
+		printf("bench receiver=%04x mode=%s n=%d lost=%d "
+		       "p50=%.3f p95=%.3f p99=%.3f max=%.3f ops/s=%.1f\n",
+		       dev->product, name[i], n, n - m,
+		       pct(lat, m, 50), pct(lat, m, 95), pct(lat, m, 99), pct(lat, m, 100),
+		       t > 0 ? m * 1e6 / t : 0);
+	}
+	fatal_jmp = old;
+	free(lat);
+}
+
+/*** commands ***/
+
+static void run_op(struct dev *dev, struct op *op)
+{
+	int j;
+
+	switch (op->type)
+	{
+		case OP_CMD:
+			mx_cmd(dev, op->buf[0], op->buf[3], op->buf[4], op->buf[5]);
+			break;
+
+		case OP_MODE:
+			mx_query(dev, op->buf[0], 0x08, op->ans);
+			print_dev(dev, op->buf[0]);
+			if (check_answer(op->ans))
+				print_mode(op->ans);
+			break;
+
+		case OP_BATTERY:
+			mx_query(dev, op->buf[0], 0x0d, op->ans);
+			print_dev(dev, op->buf[0]);
+			if (check_answer(op->ans))
+				print_battery(op->ans);
+			break;
+
+		case OP_RECONNECT:
+		{
+			static const int cmd[] = { 0xff, 0x80, 0xb2, 1, 0, 0 };
+
+			send_report(dev, 0x10, cmd, 6, 0);
+			print_dev(dev, -1);
+			printf("Reconnection initiated\n");
+			printf(" - Turn off the mouse\n");
+			printf(" - Press and hold the left mouse button\n");
+			printf(" - Turn on the mouse\n");
+			printf(" - Press the right button 5 times\n");
+			printf(" - Release the left mouse button\n");
+			wait_report(dev, 60000);
+			break;
+		}
+
+		case OP_RAW:
+			send_report(dev, op->buf[0], op->buf+1, op->n-1, 0);
+			break;
+
+		case OP_QUERY:
+			query_report(dev, op->arg1, op->buf, op->arg2);
+
+			print_dev(dev, -1);
+			printf("report %02x:", op->arg1);
+			for (j = 0; j < op->arg2; ++j)
+				printf(" %02x", op->buf[j]);
+			printf("\n");
+			break;
+
+		case OP_DUMP:
+			dump(dev, op->arg1);
+			break;
+
+		case OP_SLEEP:
+			pause_ms(op->arg1);
+			break;
+
+		case OP_BENCH:
+			bench(dev, op->arg1, op->arg2);
+			break;
+
+		case OP_TUNE:
+			tune(dev, op->arg1, op->arg2);
+			break;
+
+		case OP_FEATURE:
+			for (j = 0; j < dev->nidx; ++j)
+			{
+				int index = feature_index(dev, dev->idx[j], op->arg1);
+
+				print_dev(dev, dev->idx[j]);
+				if (index > 0)
+					printf("feature %04x at index %d\n", op->arg1, index);
+				else if (index == 0)
+					printf("feature %04x not present\n", op->arg1);
+				else
+					printf("feature %04x: %s\n", op->arg1, index == -1 ? "no HID++ 2.0" : "no answer");
+			}
+			break;
+	}
+}
+
+static int pipelined(const struct op *op)
+{
+	return op->type == OP_CMD || op->type == OP_MODE || op->type == OP_BATTERY ||
+	       op->type == OP_STATUS;
+}
+
+/*
+ * Run a sequence of HID++ requests on all devices at once.  Answers are
+ * sorted to their requests by sub-id/register as they come in.  hiddev
+ * only keeps the latest report, so with --pipeline answers arriving in a
+ * burst can get lost; those requests are simply redone one at a time.
+ */
+static void run_batch(struct dev *devs, int ndev)
+{
+	struct dev *dev;
+	struct op *ops;
+	int i, n, busy;
+
+	for (dev = devs; dev < devs + ndev; ++dev)
+	{
+		for (busy = pipeline || dev->nidx > 1, i = 0; i < dev->n; ++i)
+			busy |= dev->ops[i].type == OP_STATUS;
+		batch_start(dev, dev->ops, dev->n, busy);
+	}
+
+	for (;;)
+	{
+		for (busy = 0, dev = devs; dev < devs + ndev; ++dev)
+			busy |= dev->left;
+		if (!busy)
+			break;
+		ev_run(-1);
+	}
+
+	/* redoing a request starts a batch of its own, so keep them here */
+	for (dev = devs; dev < devs + ndev; ++dev)
+		for (ops = dev->ops, n = dev->n, i = 0; i < n; ++i)
+		{
+			struct op *op = &ops[i];
+
+			if (op->type == OP_STATUS)
+			{
+				/* the latency counts from the first try */
+				if (op->state != 1 || !valid_answer(op->ans))
+				{
+					if (!op->sent)
+						op->sent = now_us();
+					op->state = mx_query(dev, op->buf[0], op->buf[2], op->ans);
+					op->done = now_us();
+				}
+				if (op->buf[2] == 0x0d && i > 0 && ops[i - 1].type == OP_STATUS)
+					print_status(dev, &ops[i - 1], op);
+			}
+			else if (op->state == 0 || ((op->type == OP_MODE || op->type == OP_BATTERY) &&
+			                            !valid_answer(op->ans)))
+				run_op(dev, op);
+			else if (op->type == OP_MODE || op->type == OP_BATTERY)
+			{
+				print_dev(dev, op->buf[0]);
+				if (check_answer(op->ans))
+				{
+					if (op->type == OP_MODE)
+						print_mode(op->ans);
+					else
+						print_battery(op->ans);
+				}
+			}
+		}
+}
+
+/*
+ * What a write to register 0x56 changes, one bit each: the stored mode
+ * (bit 0) and the current one (bit 1), and the settings of its mode it
+ * doesn't leave at 0, "as previously set".  Modes 7 and 8 both set the
+ * manual buttons.  Anything else is taken to change nothing knowable.
+ */
+#define WHEEL_SLOTS	16
+
+static int wheel_sets(const struct op *op)
+{
+	const int *b = op->buf + 3;
+	int mode = b[0] & 0x7f, m = b[0] & 0x80 ? 3 : 2;
+
+	if (op->type != OP_CMD || op->buf[1] != 0x80 || op->buf[2] != 0x56 || mode < 1 || mode > 8)
+		return 0;
+	if (mode == 8)
+		return m | (b[1] ? 3 << 14 : 0);
+	if (mode == 7)
+		return m | (b[1] >> 4 ? 1 << 14 : 0) | (b[1] & 15 ? 2 << 14 : 0);
+	return m | (b[1] ? 1 << 2 * mode : 0) | (b[2] ? 2 << 2 * mode : 0);
+}
+
+/*
+ * Of a run of wheel mode writes, one whose every change a later one
+ * changes again makes no difference and is dropped; so at most one
+ * per bit of wheel_sets() is left.  Battery queries don't care;
+ * anything else (mode queries included) sees the state in between and
+ * ends the run.
+ */
+static int plan(struct op *ops, int n)
+{
+	int i, j, k, m = 0, sets, later;
+
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i; j < n && (ops[j].type == OP_CMD || ops[j].type == OP_BATTERY); ++j)
+			;
+		if (j == i)
+			j++;
+
+		for (; i < j; ++i)
+		{
+			for (later = 0, k = i + 1; k < j; ++k)
+				later |= wheel_sets(&ops[k]);
+			if ((sets = wheel_sets(&ops[i])) == 0 || (sets & ~later))
+			{
+				if (m != i)
+					ops[m] = ops[i];
+				m++;
+			}
+			else
+				span(T_SKIP, now_us(), NULL, "%s overwritten later", hex(ops[i].buf + 1, ops[i].n - 1));
+		}
+	}
+	return m;
+}
+
+/* kept across calls, a request aborted by fatal() must not leak them */
+static struct op *grow_ops(struct op **ops, int *max, int n)
+{
+	if (n > *max)
+	{
+		free(*ops);
+		*ops = malloc(n * sizeof(**ops));
+		if (*ops == NULL)
+			*max = 0, fatal("out of memory");
+		*max = n;
+	}
+	return *ops;
+}
+
+static struct op *alloc_ops(int n)
+{
+	static struct op *ops;
+	static int max;
+
+	return memset(grow_ops(&ops, &max, n), 0, n * sizeof(*ops));
+}
+
+/* whether the receiver knows the command, tells if not; `say' once per op */
+static int supported(struct dev *dev, const struct op *op, int say)
+{
+	int need = 0;
+
+	switch (op->type)
+	{
+		case OP_CMD:
+		case OP_MODE:
+			need = C_WHEEL;
+			break;
+		case OP_BATTERY:
+			need = C_BATTERY;
+			break;
+		case OP_STATUS:
+			need = C_WHEEL | C_BATTERY;
+			break;
+		case OP_TUNE:
+			need = C_WHEEL;
+			break;
+		case OP_RECONNECT:
+			need = C_RECONNECT;
+			break;
+	}
+	if (!(need & ~dev->model->cmds))
+		return 1;
+	if (say)
+	{
+		print_dev(dev, -1);
+		printf("not supported by %04x\n", dev->product);
+	}
+	return 0;
+}
+
+/*
+ * Asks the receivers wheel_doubt() is unsure about for their wheel
+ * mode, all at once.  One that is not in the cached mode any more is
+ * marked unknown, so wheel_filter() lets its write through.
+ */
+static void wheel_check(struct dev *devs, int ndev)
+{
+	static struct op q[MAX_DEVS];
+	struct op *ops[MAX_DEVS];
+	int d, n[MAX_DEVS], busy;
+
+	for (busy = d = 0; d < ndev; ++d)
+	{
+		ops[d] = devs[d].ops;
+		n[d] = devs[d].n;
+		if (!wheel_doubt(&devs[d], ops[d], n[d]))
+			continue;
+		hidpp_op(&q[d], OP_MODE, 0x81, 0x08, 0, 0, 0);
+		q[d].buf[0] = devs[d].first_byte;
+		batch_start(&devs[d], &q[d], 1, 0);
+		busy = 1;
+	}
+
+	while (busy)
+	{
+		ev_run(-1);
+		for (busy = d = 0; d < ndev; ++d)
+			busy |= devs[d].left;
+	}
+
+	for (d = 0; d < ndev; ++d)
+	{
+		struct dev *dev = &devs[d];
+
+		if (dev->ops == &q[d] && (q[d].state != 1 || !valid_answer(q[d].ans) ||
+		    (q[d].ans[5] & 1) != ((dev->wheel[0] & 0x7f) == 2)))
+		{
+			span(T_QUERY, now_us(), dev, "wheel mode not as cached");
+			dev->wheel_state = -1;
+		}
+		dev->ops = ops[d];
+		dev->n = n[d];
+	}
+}
+
+/*
+ * Every device gets its own copy of the command list, the HID++
+ * requests once for each index they go to.  Runs of those are done as
+ * a batch on all devices together, everything else is done device by
+ * device.
+ */
+static void run_ops(struct dev *devs, int ndev, struct op *ops, int n)
+{
+	static struct op *fan;
+	static int max;
+	struct dev *dev;
+	int d, i, j, k, l;
+
+	for (d = 0; d < ndev; ++d)
+		dev_targets(&devs[d]);
+	grow_ops(&fan, &max, ndev * n * MAX_INDEX);
+
+	for (i = 0; i < n; i = j)
+	{
+		j = i + 1;
+		if (!pipelined(&ops[i]))
+		{
+			for (d = 0; d < ndev; ++d)
+			{
+				fan[d] = ops[i];
+				if (supported(&devs[d], &fan[d], 1))
+					run_op(&devs[d], &fan[d]);
+			}
+			continue;
+		}
+
+		while (j < n && pipelined(&ops[j]))
+			j++;
+		for (d = 0; d < ndev; ++d)
+		{
+			dev = &devs[d];
+			dev->ops = fan + d * n * MAX_INDEX;
+			dev->n = 0;
+			for (k = 0; k < dev->nidx; ++k)
+				for (l = i; l < j; ++l)
+				{
+					if (!supported(dev, &ops[l], k == 0))
+						continue;
+					dev->ops[dev->n] = ops[l];
+					dev->ops[dev->n++].buf[0] = dev->idx[k];
+				}
+		}
+		if (if_changed)
+		{
+			wheel_check(devs, ndev);
+			for (d = 0; d < ndev; ++d)
+				devs[d].n = wheel_filter(&devs[d], devs[d].ops, devs[d].n);
+		}
+		run_batch(devs, ndev);
+	}
+}
+
+/*** sequences ***/
+
+/*
+ * wait=ms pauses, at=ms waits until ms after the start of the sequence,
+ * repeat=n runs the commands after it n times, each round starting the
+ * clock for at= anew.  The commands between them are a step; each one
+ * is timed and summed up at the end.
+ */
+#define MAX_STEPS	64
+
+static const char *op_name[] =
+{
+	"cmd", "mode", "battery", "reconnect", "raw", "query", "dump", "sleep",
+	"bench", "feature", "wait", "at", "repeat", "status", "tune"
+};
+
+struct step
+{
+	int first, n;
+	int count, late;	// late: at= steps that started past their time
+	long long min, max, sum;	// us
+};
+
+static int is_timing(const struct op *op)
+{
+	return op->type == OP_WAIT || op->type == OP_AT || op->type == OP_REPEAT;
+}
+
+static void step_name(const struct op *ops, const struct step *st, char *buf, int size)
+{
+	int i, k = 0;
+
+	*buf = '\0';
+	for (i = st->first; i < st->first + st->n && k < size; ++i)
+		k += snprintf(buf + k, size - k, "%s%s", k ? " " : "", op_name[ops[i].type]);
+	if (ops[st->first].type == OP_WAIT || ops[st->first].type == OP_AT)
+		snprintf(buf + k, size - k > 0 ? size - k : 0, "=%d", ops[st->first].arg1);
+}
+
+static void run_step(struct dev *devs, int ndev, struct op *ops, struct step *st, long long t0)
+{
+	struct op *op = &ops[st->first];
+	long long t = now_us(), d;
+	char name[64];
+
+	if (op->type == OP_WAIT)
+		pause_ms(op->arg1);
+	else if (op->type == OP_AT)
+	{
+		if (t > t0 + op->arg1 * 1000LL)
+			st->late++;
+		sleep_until(t0 + op->arg1 * 1000LL);
+	}
+	else
+		run_ops(devs, ndev, op, st->n);
+
+	d = now_us() - t;
+	if (st->count++ == 0 || d < st->min)
+		st->min = d;
+	if (d > st->max)
+		st->max = d;
+	st->sum += d;
+	if (trace)
+	{
+		step_name(ops, st, name, sizeof(name));
+		span(T_STEP, t, NULL, "%s", name);
+	}
+}
+
+static void run_seq(struct dev *devs, int ndev, struct op *ops, int n)
+{
+	struct step steps[MAX_STEPS];
+	int i, j, k, nstep = 0, body = -1, rounds = 1;
+	long long t0;
+	char name[64];
+
+	for (i = 0; i < n; i = j)
+	{
+		j = i + 1;
+		if (ops[i].type == OP_REPEAT)
 		{
-			static const int cmd[] = { 0xff, 0x80, 0xb2, 1, 0, 0 };
+			if (body >= 0)
+				fatal("only one repeat= per sequence");
+			body = nstep, rounds = ops[i].arg1;
+			continue;
+		}
+		if (!is_timing(&ops[i]))
+			while (j < n && !is_timing(&ops[j]))
+				j++;
+		if (nstep == MAX_STEPS)
+			fatal("more than %d steps", MAX_STEPS);
+		memset(&steps[nstep], 0, sizeof(*steps));
+		steps[nstep].first = i;
+		steps[nstep++].n = j - i;
+	}
+	if (body < 0)
+		body = nstep;
+
+	t0 = now_us();
+	for (k = 0; k < body; ++k)
+		run_step(devs, ndev, ops, &steps[k], t0);
+	for (i = 0; i < rounds && body < nstep; ++i)
+	{
+		t0 = now_us();
+		for (k = body; k < nstep; ++k)
+			run_step(devs, ndev, ops, &steps[k], t0);
+	}
+
+	printf("%-4s %-24s %8s %10s %10s %10s\n", "step", "", "runs", "min ms", "avg ms", "max ms");
+	for (k = 0; k < nstep; ++k)
+	{
+		step_name(ops, &steps[k], name, sizeof(name));
+		printf("%-4d %-24.24s %8d %10.3f %10.3f %10.3f", k + 1, name, steps[k].count,
+		       steps[k].min / 1000.0, steps[k].sum / 1000.0 / steps[k].count, steps[k].max / 1000.0);
+		if (steps[k].late)
+			printf("  %d late", steps[k].late);
+		printf("\n");
+	}
+}
+
+static void configure(struct dev *devs, int ndev, int argc, char **argv)
+{
+	struct op *ops = alloc_ops(2 * argc);
+	int i, n = plan(ops, parse_args(argc, argv, ops));
+
+	for (i = 0; i < n && !is_timing(&ops[i]); ++i)
+		;
+	if (i < n)
+		run_seq(devs, ndev, ops, n);
+	else
+		run_ops(devs, ndev, ops, n);
+}
+
+/*** profiles ***/
+
+/*
+ * A profile is a text file of mode commands as on the command line,
+ * `#' starts a comment.  --compile checks it once and stores the HID++
+ * frames in a program file, --apply sends them pipelined without parsing
+ * anything.  That's quick enough for a udev RUN rule.
+ *
+ * The program is "rvc" and version 1, the number of frames (16 bit,
+ * little endian) and 6 bytes per frame.  Their first byte gets the
+ * device index.
+ */
+#define PROG_MAGIC	"rvc\1"
+#define MAX_PROG	256
+
+/* the whole file with the comments blanked out */
+static char *read_profile(const char *file)
+{
+	static char text[65536];
+	char *p;
+	int fd, n, len = 0;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		fatal("%s: %s", file, strerror(errno));
+	/* a pipe or a slow file system may hand it out in pieces */
+	while ((n = read(fd, text + len, sizeof(text) - len)) != 0)
+	{
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || (len += n) == sizeof(text))
+		{
+			close(fd);
+			fatal("%s: %s", file, n < 0 ? strerror(errno) : "too big");
+		}
+	}
+	close(fd);
+	text[len] = '\0';
+
+	for (p = text; (p = strchr(p, '#')); )
+		while (*p && *p != '\n')
+			*p++ = ' ';
+	return text;
+}
+
+/* splits `text' at white space into av[1...], returns argc */
+static int split_args(char *text, char **av, const char *file)
+{
+	char *p;
+	int ac = 1;
+
+	av[0] = "revoco";
+	for (p = strtok(text, " \t\r\n"); p; p = strtok(NULL, " \t\r\n"))
+	{
+		if (ac > MAX_PROG)
+			fatal("%s: too many commands", file);
+		av[ac++] = p;
+	}
+	return ac;
+}
+
+/* parses and folds the mode commands in av, refuses anything else */
+static struct op *mode_ops(const char *file, int ac, char **av, int *n)
+{
+	struct op *ops = alloc_ops(2 * ac);
+	int i;
+
+	*n = parse_args(ac, av, ops);
+	for (i = 0; i < *n; ++i)
+		if (ops[i].type != OP_CMD)
+			fatal("%s: `%s' does not set the wheel mode", file, av[i + 1]);
+	*n = plan(ops, *n);
+	return ops;
+}
+
+static void compile(const char *prog, const char *profile)
+{
+	unsigned char out[6 + 6 * MAX_PROG];
+	char *av[MAX_PROG + 1], tmp[4096];
+	struct op *ops;
+	int fd, len, ac, i, j, n;
+
+	ac = split_args(read_profile(profile), av, profile);
+	ops = mode_ops(profile, ac, av, &n);
+
+	memcpy(out, PROG_MAGIC, 4);
+	out[4] = n & 0xff;
+	out[5] = n >> 8;
+	for (i = 0; i < n; ++i)
+		for (j = 0; j < 6; ++j)
+			out[6 + 6 * i + j] = ops[i].buf[j];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", prog);
+	len = 6 + 6 * n;
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		fatal("%s: %s", tmp, strerror(errno));
+	if (write(fd, out, len) != len || close(fd) == -1 || rename(tmp, prog) == -1)
+	{
+		unlink(tmp);
+		fatal("%s: %s", prog, strerror(errno));
+	}
+}
+
+static void apply(struct dev *devs, int ndev, const char *prog)
+{
+	unsigned char in[6 + 6 * MAX_PROG + 1], *f;
+	struct op *ops;
+	int fd, len, i, n;
+
+	if ((fd = open(prog, O_RDONLY)) == -1 || (len = read(fd, in, sizeof(in))) < 0)
+		fatal("%s: %s", prog, strerror(errno));
+	close(fd);
+
+	n = len >= 6 ? in[4] | in[5] << 8 : 0;
+	if (len < 6 || memcmp(in, PROG_MAGIC, 4) != 0 || n > MAX_PROG || len != 6 + 6 * n)
+		fatal("%s: not a revoco program", prog);
+	if (n == 0)
+		return;
+
+	ops = alloc_ops(n);
+	for (i = 0; i < n; ++i)
+	{
+		f = in + 6 + 6 * i;
+		if (f[1] != 0x80 || f[2] != 0x56)
+			fatal("%s: not a revoco program", prog);
+		hidpp_op(&ops[i], OP_CMD, f[1], f[2], f[3], f[4], f[5]);
+	}
+	pipeline = 1;
+	run_ops(devs, ndev, ops, n);
+}
+
+static void usage(void)
+{
+	printf("Revoco v"VERSION" - Change the wheel behaviour of "
+				    "Logitech's MX-Revolution mouse.\n\n");
+	printf("Usage:\n");
+	printf("  revoco free                      free spinning mode\n");
+	printf("  revoco click                     click-to-click mode\n");
+	printf("  revoco manual[=button[,button]]  manual mode change via button\n");
+	printf("  revoco auto[=speed[,speed]]      automatic mode change (up, down)\n");
+	printf("  revoco tune[=seconds]            suggest auto= speeds from your scrolling\n");
+	printf("  revoco auto-tune[=seconds]       and set them\n");
+	printf("  revoco battery                   query battery status\n");
+	printf("  revoco mode                      query scroll wheel mode\n");
+	printf("  revoco status                    mode and battery at once, as JSON\n");
+	printf("  revoco reconnect                 initiate reconnection\n");
+	printf("  revoco bench[=count[,warmup]]    time mode/battery queries\n");
+	printf("  revoco feature=id                HID++ 2.0 feature index\n");
+	printf("  revoco ... wait=ms at=ms ...     pause, or until ms into the sequence\n");
+	printf("  revoco ... repeat=n ...          run the commands after it n times\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -p, --pipeline  send all requests at once and collect the answers\n");
+	printf("  -a, --all       configure all receivers found, not just the first\n");
+	printf("  -b, --binary    dump events as raw struct hiddev_usage_ref records\n");
+	printf("  -r, --hidraw    talk to the receiver through hidraw instead of hiddev\n");
+	printf("  -m, --mock      talk to a simulated receiver instead of a real one,\n");
+	printf("                  --mock=ms,n gives n of them answering after ms\n");
+	printf("  -c, --if-changed\n");
+	printf("                  skip wheel mode writes the mouse already has\n");
+	printf("  -t, --trace     log how long each step takes to stderr\n");
+	printf("  --deadline=ms   fail if not done after ms milliseconds\n");
+	printf("  --compile=prog  check the commands in a profile file and store them\n");
+	printf("  --apply=prog    send the commands stored by --compile\n");
+	printf("  --index=n[,n...]  send to these devices paired to a Unifying receiver,\n");
+	printf("                  --index=all to all of them\n");
+	printf("  --monitor[=min,max]  let the daemon watch the battery, asking every\n");
+	printf("                  min to max seconds (60,3600)\n");
+	printf("  --tune          let the daemon keep track of the wheel speeds\n");
+	printf("                  (hiddev only, hidraw doesn't see the wheel)\n");
+	printf("  -s, --snapshot  show what a running daemon last heard from the mouse\n");
+	printf("  --capture=file  have dump write a capture of the events to file\n");
+	printf("  --decode=file   print a capture\n");
+	printf("  --filter=expr   dump only some events, HID++ messages one per line\n");
+	printf("  --replay=file[,x]  a mock sends the events of a capture, x times as\n");
+	printf("                  fast (1), 0 for as fast as it goes\n");
+	printf("  --focus=class   tell the daemon which window class has the focus\n");
+	printf("  --focus-map=file  the daemon's wheel modes per window class\n");
+	printf("  -d, --daemon    keep the device open and serve requests on a socket\n");
+	printf("\n");
+	printf("While a daemon is running, revoco passes its commands on to it.\n");
+	printf("The socket is $REVOCO_SOCKET or $XDG_RUNTIME_DIR/revoco.sock.\n");
+	printf("\n");
+	printf("Prefixing the mode with 'temp-' (i.e. temp-free) switches the mode\n");
+	printf("temporarily, otherwise it becomes the default mode after power up.\n");
+	printf("\n");
+	printf("Button numbers:\n");
+	printf("  0 previously set button   7 wheel left tilt\n");
+	printf("  3 middle (wheel button)   8 wheel right tilt\n");
+	printf("  4 rear thumb button       9 thumb wheel forward\n");
+	printf("  5 front thumb button     11 thumb wheel backward\n");
+	printf("  6 find button            13 thumb wheel pressed\n");
+	printf("\n");
+	quit(0);
+}
+
+static void trouble_shooting(void)
+{
+	char *path;
+	int fd;
+
+	fd = open(path = "/dev/hiddev0", O_RDWR);
+	if (fd == -1 && errno == ENOENT)
+		fd = open(path = "/dev/usb/hiddev0", O_RDWR);
+
+	if (fd != -1)
+	{
+		char ids[NMODELS * 16] = "";
+		int i, n = 0;
+
+		for (i = 0; i < NMODELS; ++i)
+			if (!(models[i].quirks & Q_EXPERIMENTAL))
+				n += sprintf(ids + n, "%s%04x:%04x", n ? ", " : "", LOGITECH, models[i].product);
+		fatal("No Logitech MX-Revolution (%s) found.", ids);
+	}
+
+	if (errno == EPERM || errno == EACCES)
+		fatal("No permission to access hiddev (%s-15)\n"
+		"Try 'sudo revoco ...'", path);
+
+	fatal("Hiddev kernel driver not found.  Check with 'dmesg | grep hiddev'\n"
+	"whether it is present in the kernel.  If it is, make sure that the device\n"
+	"nodes (either /dev/usb/hiddev0-15 or /dev/hiddev0-15) are present.  You\n"
+	"can create them with\n"
+	"\n"
+	"\tmkdir /dev/usb\n"
+	"\tmknod /dev/usb/hiddev0 c 180 96\n"
+	"\tmknod /dev/usb/hiddev1 c 180 97\n\t...\n"
+	"\n"
+	"or better by adding a rule to the udev database in\n"
+	"/etc/udev/rules.d/10-local.rules\n"
+	"\n"
+	"\tBUS=\"usb\", KERNEL=\"hiddev[0-9]*\", NAME=\"usb/%k\", MODE=\"660\"\n"
+	"\n"
+	"Sometimes running from superuser may help.\n");
+}
+
+static void parse_opts(int *argc, char ***argv)
+{
+	pipeline = all_devs = binary = trace = if_changed = tune_opt = 0;
+	use_hidraw = daemon_hidraw;
+	mock_ndev = daemon_mock;
+	mock_delay = daemon_delay;
+	monitor_min = daemon_min;
+	monitor_max = daemon_max;
+	nindex = index_all = 0;
+	compile_prog = apply_prog = focus_class = NULL;
+	capture_file = decode_file = replay_file = NULL;
+	replay_speed = 0;
+	filter.on = 0;
+	trace_t0 = now_us();
+	deadline_at = 0;
+
+	while (*argc > 1 && (*argv)[1][0] == '-')
+	{
+		char *opt = (*argv)[1];
+
+		if (streq(opt, "-h") || streq(opt, "--help"))
+			usage();
+		else if (streq(opt, "-p") || streq(opt, "--pipeline"))
+			pipeline = 1;
+		else if (streq(opt, "-a") || streq(opt, "--all"))
+			all_devs = 1;
+		else if (streq(opt, "-b") || streq(opt, "--binary"))
+			binary = 1;
+		else if (streq(opt, "-r") || streq(opt, "--hidraw"))
+			use_hidraw = 1;
+		else if (streq(opt, "-m") || strneq(opt, "--mock", 6))
+		{
+			char *p = onearg(opt + (opt[1] == 'm' ? 2 : 6), '=', &mock_delay, 10, 0, 60000);
+
+			if (*onearg(p, ',', &mock_ndev, 1, 1, MAX_DEVS))
+				fatal("malformed argument `%s'", opt);
+		}
+		else if (streq(opt, "-c") || streq(opt, "--if-changed"))
+			if_changed = 1;
+		else if (streq(opt, "-t") || streq(opt, "--trace"))
+			trace = 1;
+		else if (strneq(opt, "--deadline", 10))
+		{
+			int ms;
+
+			if (*onearg(opt + 10, '=', &ms, -1, 1, 24*60*60*1000) || ms == -1)
+				fatal("malformed argument `%s'", opt);
+			deadline_at = now_ms() + ms;
+		}
+		else if (strneq(opt, "--compile=", 10))
+			compile_prog = opt + 10;
+		else if (strneq(opt, "--apply=", 8))
+			apply_prog = opt + 8;
+		else if (streq(opt, "--index=all"))
+			index_all = 1;
+		else if (strneq(opt, "--index=", 8))
+		{
+			char *p = opt + 7;
+
+			for (nindex = 0; *p; )
+			{
+				if (nindex == MAX_INDEX)
+					fatal("too many indexes in `%s'", opt);
+				p = onearg(p, nindex ? ',' : '=', &index_list[nindex], 1, 1, 255);
+				nindex++;
+			}
+		}
+		else if (strneq(opt, "--monitor", 9))
+		{
+			char *p = onearg(opt + 9, '=', &monitor_min, 60, 1, 24*60*60);
+
+			if (*onearg(p, ',', &monitor_max, 3600, monitor_min, 7*24*60*60))
+				fatal("malformed argument `%s'", opt);
+			if (monitor_max < monitor_min)
+				monitor_max = monitor_min;
+		}
+		else if (streq(opt, "-s") || streq(opt, "--snapshot"))
+			snapshot_opt = 1;
+		else if (streq(opt, "--tune"))
+			tune_opt = 1;
+		else if (strneq(opt, "--capture=", 10))
+			capture_file = opt + 10;
+		else if (strneq(opt, "--decode=", 9))
+			decode_file = opt + 9;
+		else if (strneq(opt, "--filter=", 9))
+			parse_filter(opt + 9);
+		else if (strneq(opt, "--replay=", 9))
+		{
+			char *p = strrchr(opt, ',');
+
+			replay_speed = 1;
+			if (p && *onearg(p, ',', &replay_speed, 1, 0, 1000000))
+				fatal("malformed argument `%s'", opt);
+			if (p)
+				*p = '\0';
+			replay_file = opt + 9;
+			if (!mock_ndev)
+				mock_ndev = 1;
+		}
+		else if (strneq(opt, "--focus=", 8))
+			focus_class = opt + 8;
+		else if (strneq(opt, "--focus-map=", 12))
+			focus_file = opt + 12;
+		else if (streq(opt, "-d") || streq(opt, "--daemon"))
+			daemon_mode = 1;
+		else
+			fatal("unknown option `%s'", opt);
+		(*argc)--, (*argv)++;
+	}
+}
+
+/*** daemon ***/
+
+/*
+ * A request is one SOCK_SEQPACKET message: the NUL terminated arguments
+ * plus the client's stdout and stderr (SCM_RIGHTS), so the output goes
+ * straight to the client.  The reply is a single exit status byte.
+ */
+#define MAX_REQUEST	65536
+
+static const char *sock_path(void)
+{
+	static char buf[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *p;
+
+	if ((p = getenv("REVOCO_SOCKET")))
+		return p;
+	if (!*buf)
+		runtime_file(buf, sizeof(buf), "sock");
+	return buf;
+}
+
+static int sock_connect(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, sock_path(), sizeof(sa.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd != -1 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		close(fd), fd = -1;
+	return fd;
+}
+
+/* returns the exit status of the request or -1 if no daemon is running */
+static int client(int argc, char **argv)
+{
+	static char req[MAX_REQUEST], cwd[4096], path[8192];
+	char ctl[CMSG_SPACE(2 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	int fd, i, l, len = 0, fds[2] = { 1, 2 };
+	unsigned char st;
+
+	if ((fd = sock_connect()) == -1)
+		return -1;
+
+	for (i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+
+		/* the daemon has a cwd of its own */
+		if (strneq(arg, "--capture=", 10) && arg[10] != '/')
+		{
+			if (!getcwd(cwd, sizeof(cwd)))
+				fatal("getcwd: %s", strerror(errno));
+			snprintf(path, sizeof(path), "--capture=%s/%s", cwd, arg + 10);
+			arg = path;
+		}
+		l = strlen(arg) + 1;
+		if (len + l > MAX_REQUEST)
+			fatal("argument list too long");
+		memcpy(req + len, arg, l);
+		len += l;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != len)
+		fatal("send to daemon: %s", strerror(errno));
+	if (recv(fd, &st, 1, 0) != 1)
+		fatal("daemon did not answer");
+	close(fd);
+	return st;
+}
+
+/* if a device went away, all of them are looked for again on the next request */
+static int check_devs(struct dev *devs, int n)
+{
+	int i, gone = 0;
+
+	for (i = 0; i < n; ++i)
+	{
+		reset_dev(&devs[i]);
+		if (!devs[i].tp->info(&devs[i]))
+			gone = 1;
+	}
+	if (!gone)
+		return n;
+
+	for (i = 0; i < n; ++i)
+		close_dev(&devs[i]);
+	return 0;
+}
+
+static struct dev daemon_devs[MAX_DEVS];
+static int daemon_ndev, serving;
+
+/*
+ * Per-application wheel modes.  Whatever watches the window focus runs
+ * `revoco --focus=class'; the daemon looks the class up in the map
+ * (lines of `class commands...', `*' for all others) and waits until
+ * the focus has settled, so alt-tabbing through windows sends nothing.
+ * Then only what the mouse doesn't have already is sent.
+ */
+#define MAX_FOCUS	64
+#define FOCUS_SETTLE	200	// ms
+
+static struct
+{
+	char class[64];
+	int n;
+	int frame[WHEEL_SLOTS][6];	// plan() leaves no more
+} focus_map[MAX_FOCUS];
+static int nfocus, focus_pending = -1;
+static struct watch focus_timer;
+
+static void focus_load(const char *file)
+{
+	char *text = read_profile(file), *line, *end, *av[MAX_PROG + 1];
+	struct op *ops;
+	int ac, i, j, n;
+
+	for (line = text; line; line = end)
+	{
+		if ((end = strchr(line, '\n')))
+			*end++ = '\0';
+		if ((ac = split_args(line, av, file)) < 2)
+			continue;
+		if (nfocus == MAX_FOCUS)
+			fatal("%s: too many window classes", file);
+
+		/* the class takes the place of the program name */
+		ops = mode_ops(file, ac - 1, av + 1, &n);
+		snprintf(focus_map[nfocus].class, sizeof(focus_map[0].class), "%s", av[1]);
+		for (i = 0; i < n; ++i)
+			for (j = 0; j < 6; ++j)
+				focus_map[nfocus].frame[i][j] = ops[i].buf[j];
+		focus_map[nfocus++].n = n;
+	}
+}
+
+static void focus_request(const char *class)
+{
+	int i, def = -1;
+
+	for (i = 0; i < nfocus; ++i)
+		if (strcasecmp(focus_map[i].class, class) == 0)
+			break;
+		else if (streq(focus_map[i].class, "*"))
+			def = i;
+
+	focus_pending = i < nfocus ? i : def;
+	if (focus_pending >= 0)
+		timer_set(&focus_timer, FOCUS_SETTLE);
+}
+
+static void focus_settle(struct watch *w)
+{
+	unsigned long long x;
+	struct op *ops;
+	jmp_buf jb;
+	int i, *f, n;
+
+	if (read(w->fd, &x, sizeof(x)) != sizeof(x) || focus_pending < 0)
+		return;
+	if (serving)
+	{
+		timer_set(w, 50);
+		return;
+	}
+	if ((n = focus_map[focus_pending].n) == 0 || daemon_ndev == 0)
+		return;
+
+	ops = alloc_ops(n);
+	for (i = 0; i < n; ++i)
+	{
+		f = focus_map[focus_pending].frame[i];
+		hidpp_op(&ops[i], OP_CMD, f[1], f[2], f[3], f[4], f[5]);
+	}
+	if (setjmp(jb) == 0)
+	{
+		fatal_jmp = &jb;
+		pipeline = if_changed = 1;
+		run_ops(daemon_devs, daemon_ndev, ops, n);
+	}
+	fatal_jmp = NULL;
+}
+
+static void serve(struct dev *devs, int *ndev, int conn)
+{
+	static char req[MAX_REQUEST + 1];
+	char *argv[MAX_REQUEST / 2 + 2], **av = argv;
+	char ctl[CMSG_SPACE(2 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	jmp_buf jb;
+	int len, i, argc, out, err, fds[2] = { -1, -1 };
+	unsigned char st;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = MAX_REQUEST;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+	if ((len = recvmsg(conn, &msg, 0)) <= 0)
+		return;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+			memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+	if (fds[0] == -1 || fds[1] == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	req[len] = '\0';
+	argv[0] = "revoco";
+	for (argc = 1, i = 0; i < len; i += strlen(req + i) + 1)
+		argv[argc++] = req + i;
+	argv[argc] = NULL;
+
+	fflush(stdout);
+	fflush(stderr);
+	out = dup(1), err = dup(2);
+	dup2(fds[0], 1), dup2(fds[1], 2);
+	close(fds[0]), close(fds[1]);
+
+	if (setjmp(jb) == 0)
+	{
+		fatal_jmp = &jb;
+		parse_opts(&argc, &av);
+		if (monitor_min != daemon_min || monitor_max != daemon_max)
+			fatal("--monitor is set when the daemon is started");
+		if (focus_class)
+			focus_request(focus_class);
+		else if (argc > 1)
+		{
+			if (*ndev == 0 && (*ndev = find_devs(devs, MAX_DEVS)) == 0)
+				trouble_shooting();
+			configure(devs, all_devs ? *ndev : 1, argc, av);
+		}
+		quit(0);
+	}
+	fatal_jmp = NULL;
+	st = fatal_status;
+	deadline_at = 0;
+
+	out_flush();
+	fflush(stdout);
+	fflush(stderr);
+	dup2(out, 1), dup2(err, 2);
+	close(out), close(err);
+
+	if (st)
+		*ndev = check_devs(devs, *ndev);
+	send(conn, (unsigned char *)&st, 1, MSG_NOSIGNAL);
+}
+
+/* one request at a time, so nobody steals another one's answers */
+static void daemon_accept(struct watch *w)
+{
+	int conn;
+
+	if ((conn = accept(w->fd, NULL, NULL)) == -1)
+		return;
+
+	ev_enable(w, 0);
+	serving = 1;
+	serve(daemon_devs, &daemon_ndev, conn);
+	serving = 0;
+	close(conn);
+	ev_enable(w, 1);
+}
+
+/*
+ * Receivers coming and going show up as kernel uevents.  The device
+ * list is rebuilt a moment later, when udev had a chance to set up the
+ * node, and never in the middle of a request.  Receivers that were
+ * added get the --apply program the daemon was started with.
+ */
+static struct watch uevents, rescan;
+static const char *daemon_prog;
+static char added[MAX_DEVS][256];
+static int nadded, rescan_tries;
+
+static void daemon_apply(struct dev *dev)
+{
+	jmp_buf jb;
+
+	if (setjmp(jb) == 0)
+	{
+		fatal_jmp = &jb;
+		apply(dev, 1, daemon_prog);
+	}
+	fatal_jmp = NULL;
+}
+
+static void daemon_uevent(struct watch *w)
+{
+	char buf[4096], dir[600], *p, *action, *subsys, *name, *devpath;
+	struct sockaddr_nl sa;
+	socklen_t len = sizeof(sa);
+	int i, n, ours;
 
-			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
-			send_report(handle, 0x10, cmd, 6);
-			printf("Reconnection initiated\n");
-			printf(" - Turn off the mouse\n");
-			printf(" - Press and hold the left mouse button\n");
-			printf(" - Turn on the mouse\n");
-			printf(" - Press the right button 5 times\n");
-			printf(" - Release the left mouse button\n");
-			wait_report(handle, 60000);
-		}
-		else if (strneq(argv[i], "mode", 4))
-		{
-			int buf[6];
+	while ((n = recvfrom(w->fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&sa, &len)) > 0)
+	{
+		len = sizeof(sa);
+		if (sa.nl_pid != 0)		// only the kernel
+			continue;
+		buf[n] = '\0';
 
-			if (mx_query(handle, 0x08, buf))
+		action = subsys = name = devpath = NULL;
+		for (p = buf; p < buf + n; p += strlen(p) + 1)
+			if (strneq(p, "ACTION=", 7))
+				action = p + 7;
+			else if (strneq(p, "SUBSYSTEM=", 10))
+				subsys = p + 10;
+			else if (strneq(p, "DEVNAME=", 8))
+				name = p + 8;
+			else if (strneq(p, "DEVPATH=", 8))
+				devpath = p + 8;
+		if (!action || !subsys || !name || !devpath)
+			continue;
+		if (!(streq(subsys, "usbmisc") && strstr(name, "hiddev")) &&
+		    !(streq(subsys, "hidraw") && strstr(name, "hidraw")))
+			continue;
+
+		if (streq(action, "add"))
+		{
+			if (streq(subsys, "hidraw"))
 			{
-				if (buf[5] & 1)
-					printf("click-by-click\n");
+				snprintf(dir, sizeof(dir), "/sys%s/device", devpath);
+				ours = hid_id(dir);
+			}
 			else
-				printf("free spinning\n");
+			{
+				snprintf(dir, sizeof(dir), "/sys%s/device/..", devpath);
+				ours = mx_model(read_hex(dir, "idVendor"), read_hex(dir, "idProduct")) != NULL;
 			}
+			if (!ours)
+				continue;
+			if (daemon_prog && nadded < MAX_DEVS)
+				snprintf(added[nadded++], sizeof(added[0]), "/dev/%s", name);
+			rescan_tries = 10;
 		}
-		else if (strneq(argv[i], "battery", 7))
+		else if (streq(action, "remove"))
 		{
-			int buf[6];
+			for (i = 0; i < daemon_ndev; ++i)
+				if (streq(daemon_devs[i].path + 5, name))
+					break;
+			if (i == daemon_ndev)
+				continue;
+		}
+		else
+			continue;
+		timer_set(&rescan, 100);
+	}
+}
 
-			if (mx_query(handle, 0x0d, buf))
-			{
-				char str[32], *st;
+static void daemon_rescan(struct watch *w)
+{
+	unsigned long long x;
+	int i, j;
 
-				switch (buf[5])
-				{
-					case 0x30:	st = "running on battery";	break;
-					case 0x50:	st = "charging";		break;
-					case 0x90:	st = "fully charged";		break;
-					default:	sprintf(st = str, "status %02x", buf[5]);
-				}
-				printf("battery level %d%%, %s\n", buf[3], st);
+	if (read(w->fd, &x, sizeof(x)) != sizeof(x))
+		return;
+	if (serving)
+	{
+		timer_set(w, 100);
+		return;
+	}
+
+	for (i = 0; i < daemon_ndev; ++i)
+		close_dev(&daemon_devs[i]);
+	daemon_ndev = find_devs(daemon_devs, MAX_DEVS);
+
+	for (i = 0; i < daemon_ndev; ++i)
+		for (j = 0; j < nadded; ++j)
+			if (streq(daemon_devs[i].path, added[j]))
+			{
+				daemon_apply(&daemon_devs[i]);
+				memmove(added[j], added[j + 1], (--nadded - j) * sizeof(added[0]));
+				break;
 			}
-		}
 
-		/*** debug commands ***/
-		else if (strneq(argv[i], "raw", 3))
-		{
-			int buf[256], n;
+	/* not there or not ours to open yet */
+	if (nadded && --rescan_tries > 0)
+		timer_set(w, 200);
+	else
+		nadded = 0;
+}
 
-			n = nargs(argv[i] + 3, buf, 256, 0, 0, 255);
-			send_report(handle, buf[0], buf+1, n-1);
-		}
-		else if (strneq(argv[i], "query", 5))
-		{
-			int buf[256], j;
+static void hotplug(void)
+{
+	struct sockaddr_nl sa;
+	int fd, tfd;
 
-			twoargs(argv[i] + 5, &arg1, &arg2, -1, 0, 255);
-			if (arg1 == -1)
-				arg1 = 0x10, arg2 = 6;
-			query_report(handle, arg1, buf, arg2);
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1;		// kernel uevents
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+	{
+		printf("no hotplug: %s\n", strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		fatal("timerfd_create: %s", strerror(errno));
+	ev_add(&uevents, fd, daemon_uevent, NULL);
+	ev_add(&rescan, tfd, daemon_rescan, NULL);
+}
 
-			printf("report %02x:", arg1);
-			for (j = 0; j < arg2; ++j)
-				printf(" %02x", buf[j]);
-			printf("\n");
-		}
-		else if (strneq(argv[i], "dump", 4))
-		{
-			twoargs(cmd + 4, &arg1, &arg2, 3, -1, 24*60*60);
-			if (arg1 > 0)
-				arg1 *= 1000;
-			while (wait_for_input(handle, arg1) > 0)
-			{
-				struct hiddev_usage_ref uref;
+/*
+ * A receiver the monitor hasn't seen before is asked for battery
+ * notifications first (register 0x00, byte 0 bit 4).  Those that
+ * don't know it are left to polling.
+ */
+static void monitor_notify(struct dev *dev)
+{
+	int get[6] = { dev->first_byte, 0x81, 0x00, 0, 0, 0 };
+	int set[6] = { dev->first_byte, 0x80, 0x00, 0, 0, 0 }, ans[6];
 
-				if (read(handle, &uref, sizeof(uref)) == sizeof(uref))
-					printf("read: type=%u, id=%u, field=%08x, usage=%08x,"
-						" code=%08x, value=%u\n",
-						uref.report_type, uref.report_id, uref.field_index,
-						uref.usage_index, uref.usage_code, uref.value);
-			}
-		}
-		else if (strneq(argv[i], "sleep", 5))
+	if (send_report(dev, 0x10, get, 6, ans) != 1)
+		return;
+	if (ans[3] & 0x10)
+		dev->notified = 1;
+	set[3] = ans[3] | 0x10, set[4] = ans[4], set[5] = ans[5];
+	send_report(dev, 0x10, set, 6, ans);
+}
+
+static void monitor_poll(struct watch *w)
+{
+	unsigned long long x;
+	struct dev *dev;
+	jmp_buf jb;
+	int first, res[6];
+
+	if (read(w->fd, &x, sizeof(x)) != sizeof(x))
+		return;
+	monitor_at = 0;
+	if (serving)
+	{
+		monitor_due(now_ms() + 100);
+		return;
+	}
+
+	for (dev = daemon_devs; dev < daemon_devs + daemon_ndev; ++dev)
+	{
+		if (dev->poll_at > now_ms())
+			continue;
+		/* without an answer, try again after the same time */
+		dev->poll_at = now_ms() + (dev->poll_ms ? dev->poll_ms : monitor_min * 1000);
+		if (setjmp(jb) == 0)
 		{
-			twoargs(argv[i] + 5, &arg1, &arg2, 1, 0, 255);
-			sleep(arg1);
+			fatal_jmp = &jb;
+			/* switching notifications on may have told already */
+			if ((first = dev->poll_ms == 0))
+				monitor_notify(dev);
+			if (!first || dev->poll_ms == 0)
+				mx_query(dev, dev->first_byte, 0x0d, res);
 		}
-		else
-			fatal("unknown option `%s'", argv[i]);
+		fatal_jmp = NULL;
 	}
+
+	monitor_at = 0;
+	for (dev = daemon_devs; dev < daemon_devs + daemon_ndev; ++dev)
+		monitor_due(dev->poll_at);
 }
 
-static void usage(void)
+static void unlink_sock(int sig)
 {
-	printf("Revoco v"VERSION" - Change the wheel behaviour of "
-				    "Logitech's MX-Revolution mouse.\n\n");
-	printf("Usage:\n");
-	printf("  revoco free                      free spinning mode\n");
-	printf("  revoco click                     click-to-click mode\n");
-	printf("  revoco manual[=button[,button]]  manual mode change via button\n");
-	printf("  revoco auto[=speed[,speed]]      automatic mode change (up, down)\n");
-	printf("  revoco battery                   query battery status\n");
-	printf("  revoco mode                      query scroll wheel mode\n");
-	printf("  revoco reconnect                 initiate reconnection\n");
-	printf("\n");
-	printf("Prefixing the mode with 'temp-' (i.e. temp-free) switches the mode\n");
-	printf("temporarily, otherwise it becomes the default mode after power up.\n");
-	printf("\n");
-	printf("Button numbers:\n");
-	printf("  0 previously set button   7 wheel left tilt\n");
-	printf("  3 middle (wheel button)   8 wheel right tilt\n");
-	printf("  4 rear thumb button       9 thumb wheel forward\n");
-	printf("  5 front thumb button     11 thumb wheel backward\n");
-	printf("  6 find button            13 thumb wheel pressed\n");
-	printf("\n");
-	exit(0);
+	char name[512];
+
+	unlink(sock_path());
+	if (runtime_file(name, sizeof(name), "status"))
+		unlink(name);
+	_exit(0);
 }
 
-static void trouble_shooting(void)
+static FILE *hist_out;
+
+/* SIGUSR1: the histogram goes to the daemon's own stderr, not a client's */
+static void hist_signal(struct watch *w)
 {
-	char *path;
-	int fd;
+	struct signalfd_siginfo si;
 
-	fd = open(path = "/dev/hiddev0", O_RDWR);
-	if (fd == -1 && errno == ENOENT)
-		fd = open(path = "/dev/usb/hiddev0", O_RDWR);
+	if (read(w->fd, &si, sizeof(si)) == sizeof(si))
+		hist_print(hist_out);
+}
 
-	if (fd != -1)
-		fatal("No Logitech MX-Revolution"
-		      "(%04x:%04x, %04x:%04x, %04x:%04x, %04x:%04x, or %04x:%04x) found.",
-		      LOGITECH, MX_REVOLUTION,
-		      LOGITECH, MX_REVOLUTION2,
-		      LOGITECH, MX_REVOLUTION3,
-		      LOGITECH, MX_REVOLUTION4,
-		      LOGITECH, MX_REVOLUTION5
-			  );
+static void run_daemon(void)
+{
+	static struct watch listener, usr1;
+	struct sockaddr_un sa;
+	sigset_t mask;
+	int lfd, conn;
 
-	if (errno == EPERM || errno == EACCES)
-		fatal("No permission to access hiddev (%s-15)\n"
-		"Try 'sudo revoco ...'", path);
+	if (!*sock_path())
+		fatal("no private runtime directory for the socket, set $XDG_RUNTIME_DIR");
+	if ((conn = sock_connect()) != -1)
+		fatal("daemon already running on %s", sock_path());
 
-	fatal("Hiddev kernel driver not found.  Check with 'dmesg | grep hiddev'\n"
-	"whether it is present in the kernel.  If it is, make sure that the device\n"
-	"nodes (either /dev/usb/hiddev0-15 or /dev/hiddev0-15) are present.  You\n"
-	"can create them with\n"
-	"\n"
-	"\tmkdir /dev/usb\n"
-	"\tmknod /dev/usb/hiddev0 c 180 96\n"
-	"\tmknod /dev/usb/hiddev1 c 180 97\n\t...\n"
-	"\n"
-	"or better by adding a rule to the udev database in\n"
-	"/etc/udev/rules.d/10-local.rules\n"
-	"\n"
-	"\tBUS=\"usb\", KERNEL=\"hiddev[0-9]*\", NAME=\"usb/%k\", MODE=\"660\"\n"
-	"\n"
-	"Sometimes running from superuser may help.\n");
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, sock_path(), sizeof(sa.sun_path) - 1);
+	unlink(sa.sun_path);
+
+	umask(077);
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    listen(lfd, 16) == -1)
+		fatal("%s: %s", sa.sun_path, strerror(errno));
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, unlink_sock);
+	signal(SIGTERM, unlink_sock);
+
+	if ((histogram = trace))
+	{
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		if ((hist_out = fdopen(dup(2), "w")) == NULL ||
+		    (conn = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+			fatal("signalfd: %s", strerror(errno));
+		ev_add(&usr1, conn, hist_signal, NULL);
+	}
+
+	if ((tuning = tune_opt) && use_hidraw)
+		fatal("the wheel doesn't show on hidraw, --tune needs hiddev");
+	daemon_hidraw = use_hidraw;
+	daemon_mock = mock_ndev;
+	daemon_delay = mock_delay;
+	daemon_min = monitor_min;
+	daemon_max = monitor_max;
+
+	if (monitor_max)
+	{
+		if ((conn = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			fatal("timerfd_create: %s", strerror(errno));
+		ev_add(&monitor_timer, conn, monitor_poll, NULL);
+	}
+
+	/* all receivers are kept open, --all decides which ones a request uses */
+	status_open();
+	daemon_ndev = find_devs(daemon_devs, MAX_DEVS);
+	if ((daemon_prog = apply_prog) && daemon_ndev)
+		apply(daemon_devs, daemon_ndev, daemon_prog);
+	if (!mock_ndev)
+		hotplug();
+	if (focus_file)
+	{
+		focus_load(focus_file);
+		if ((conn = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+			fatal("timerfd_create: %s", strerror(errno));
+		ev_add(&focus_timer, conn, focus_settle, NULL);
+	}
+
+	ev_add(&listener, lfd, daemon_accept, NULL);
+	for (;;)
+		ev_run(-1);
 }
 
+
 int main(int argc, char **argv)
 {
-	int handle;
+	struct dev devs[MAX_DEVS];
+	int i, n, st, oargc = argc;
+	char **oargv = argv, *name = strrchr(argv[0], '/');
 
-	if (argc < 2)
-		usage();
-	if (argc > 1 && (streq(argv[1], "-h") || streq(argv[1], "--help")))
+	if (streq(name ? name + 1 : argv[0], "revocod"))
+		daemon_mode = 1;
+
+	parse_opts(&argc, &argv);
+
+	if (compile_prog)
+	{
+		if (argc != 2)
+			fatal("--compile wants one profile file");
+		compile(compile_prog, argv[1]);
+		exit(0);
+	}
+
+	if (snapshot_opt)
+	{
+		snapshot();
+		exit(0);
+	}
+
+	if (decode_file)
+	{
+		decode(decode_file);
+		exit(0);
+	}
+
+	if (daemon_mode)
+		run_daemon();
+
+	if (argc < 2 && !apply_prog && !focus_class)
 		usage();
 
-	handle = open_dev("/dev/usb/hiddev%d");
-	if (handle == -1)
-		handle = open_dev("/dev/hiddev%d");
-	if (handle == -1)
-		trouble_shooting();
+	/* a mock is ours alone, a program is read right here */
+	if (!mock_ndev && !apply_prog && (st = client(oargc, oargv)) >= 0)
+		exit(st);
+	if (focus_class)
+		fatal("--focus needs a running daemon");
 
-	init_dev(handle);
+	n = find_devs(devs, all_devs ? MAX_DEVS : 1);
+	if (n == 0)
+		trouble_shooting();
 
-	configure(handle, argc, argv);
+	if (apply_prog)
+		apply(devs, n, apply_prog);
+	else
+		configure(devs, n, argc, argv);
 
-	close_dev(handle);
+	for (i = 0; i < n; ++i)
+		close_dev(&devs[i]);
 	exit(0);
 }
 
+#else
+
+/*** library ***/
+
+/*
+ * librevoco is this file without main(), see revoco.h.  Requests go
+ * straight into the device's table of requests in flight, those that
+ * don't fit wait their turn.  Nothing runs the loop but rv_dispatch(),
+ * and each entry point catches fatal().
+ */
+#define RV_QUEUE	32
+
+enum { RV_FREE, RV_QUEUED, RV_SENT, RV_DONE, RV_FAILED };
+
+struct rv_req
+{
+	struct op op;		// first, rv_done() gets this
+	int stage;
+	unsigned int seq;	// keeps them in order
+	rv_callback *cb;
+	void *arg;
+};
+
+struct rv_dev
+{
+	struct dev dev;
+	struct rv_req q[RV_QUEUE];
+	unsigned int seq;
+};
+
+static struct rv_dev *rv_devs[MAX_DEVS];
+
+const char *rv_error(void)
+{
+	return fatal_msg;
+}
+
+static int rv_fail(int err, const char *what)
+{
+	snprintf(fatal_msg, sizeof(fatal_msg), "%s: %s", what, strerror(err));
+	return -err;
+}
+
+int rv_fd(void)
+{
+	if (ev_fd == -1 && (ev_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return rv_fail(errno, "epoll_create");
+	return ev_fd;
+}
+
+const char *rv_path(const struct rv_dev *r)
+{
+	return r->dev.path;
+}
+
+int rv_index(const struct rv_dev *r)
+{
+	return r->dev.first_byte;
+}
+
+/* takes over a device opened by scan_devs() or add_dev() */
+static int rv_add(struct dev *dev, struct rv_dev **rp)
+{
+	struct rv_dev *r;
+	jmp_buf jb, *old = fatal_jmp;
+	int i;
+
+	for (i = 0; i < MAX_DEVS && rv_devs[i]; ++i)
+		;
+	if (i == MAX_DEVS || (r = calloc(1, sizeof(*r))) == NULL)
+	{
+		close(dev->fd);
+		return rv_fail(i == MAX_DEVS ? EMFILE : ENOMEM, dev->path);
+	}
+	r->dev = *dev;
+
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		close(r->dev.fd);
+		free(r);
+		return -EIO;
+	}
+	fatal_jmp = &jb;
+	init_dev(&r->dev);
+	fatal_jmp = old;
+
+	*rp = rv_devs[i] = r;
+	return 0;
+}
+
+int rv_open(const char *path, struct rv_dev **rp)
+{
+	struct dev dev;
+
+	memset(&dev, 0, sizeof(dev));
+	errno = ENODEV;		// unless open() says otherwise
+	if (add_dev(&dev, 0, path, strneq(path, "/dev/hidraw", 11) ? &hidraw_tp : &hiddev_tp) == 0)
+		return rv_fail(errno, path);
+	return rv_add(&dev, rp);
+}
+
+int rv_find(struct rv_dev **devs, int max)
+{
+	struct dev found[MAX_DEVS];
+	jmp_buf jb, *old = fatal_jmp;
+	int i, n, m = 0, err = 0;
+
+	if (max > MAX_DEVS)
+		max = MAX_DEVS;
+	memset(found, 0, sizeof(found));
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		return -EIO;
+	}
+	fatal_jmp = &jb;
+	n = scan_devs(found, max);
+	fatal_jmp = old;
+
+	for (i = 0; i < n; ++i)
+		if ((err = rv_add(&found[i], &devs[m])) == 0)
+			m++;
+	return m ? m : n ? err : rv_fail(ENODEV, "no receiver found");
+}
+
+void rv_close(struct rv_dev *r)
+{
+	int i;
+
+	for (i = 0; i < MAX_DEVS; ++i)
+		if (rv_devs[i] == r)
+			rv_devs[i] = NULL;
+	batch_stop(&r->dev);
+	close_dev(&r->dev);
+	free(r);
+}
+
+static void rv_done(struct dev *dev, struct op *op)
+{
+	((struct rv_req *)op)->stage = RV_DONE;
+}
+
+/* puts queued requests in flight as long as there is room */
+static void rv_pump(struct rv_dev *r)
+{
+	struct rv_req *q;
+	jmp_buf jb, *old = fatal_jmp;
+	int i;
+
+	while (r->dev.npend < MAX_PENDING)
+	{
+		for (q = NULL, i = 0; i < RV_QUEUE; ++i)
+			if (r->q[i].stage == RV_QUEUED && (!q || (int)(r->q[i].seq - q->seq) < 0))
+				q = &r->q[i];
+		if (q == NULL)
+			return;
+
+		q->stage = RV_SENT;
+		if (setjmp(jb))
+		{
+			fatal_jmp = old;
+			q->stage = RV_FAILED;
+			continue;
+		}
+		fatal_jmp = &jb;
+		req_send(&r->dev, &q->op);
+		fatal_jmp = old;
+	}
+}
+
+int rv_submit(struct rv_dev *r, const unsigned char req[6], rv_callback *cb, void *arg)
+{
+	struct rv_req *q;
+	int i;
+
+	for (i = 0; i < RV_QUEUE && r->q[i].stage != RV_FREE; ++i)
+		;
+	if (i == RV_QUEUE)
+		return rv_fail(EAGAIN, r->dev.path);
+
+	q = &r->q[i];
+	memset(&q->op, 0, sizeof(q->op));
+	q->op.type = OP_RAW;
+	q->op.n = 6;
+	for (i = 0; i < 6; ++i)
+		q->op.buf[i] = req[i];
+	q->op.fn = rv_done;
+	q->stage = RV_QUEUED;
+	q->seq = r->seq++;
+	q->cb = cb;
+	q->arg = arg;
+
+	/* a request that can't even be sent isn't taken */
+	rv_pump(r);
+	if (q->stage == RV_FAILED)
+	{
+		q->stage = RV_FREE;
+		return -EIO;
+	}
+	return 0;
+}
+
+int rv_cmd(struct rv_dev *r, int b1, int b2, int b3, rv_callback *cb, void *arg)
+{
+	unsigned char req[6] = { r->dev.first_byte, 0x80, 0x56, b1, b2, b3 };
+
+	return rv_submit(r, req, cb, arg);
+}
+
+int rv_query(struct rv_dev *r, int reg, rv_callback *cb, void *arg)
+{
+	unsigned char req[6] = { r->dev.first_byte, 0x81, reg, 0, 0, 0 };
+
+	return rv_submit(r, req, cb, arg);
+}
+
+/* hands out one request that is done and fills up the table again */
+static int rv_reap(struct rv_dev *r)
+{
+	struct rv_result res;
+	struct rv_req q;
+	int i;
+
+	for (i = 0; i < RV_QUEUE; ++i)
+		if (r->q[i].stage == RV_DONE || r->q[i].stage == RV_FAILED)
+			break;
+	if (i == RV_QUEUE)
+		return 0;
+	q = r->q[i];
+	r->q[i].stage = RV_FREE;
+
+	if (q.stage == RV_FAILED)
+		res.status = -EIO;
+	else if (q.op.state == -1)
+		res.status = -EPROTO;
+	else if (q.op.state == 1)
+		res.status = 0;
+	else
+		res.status = -ETIMEDOUT;
+	for (i = 0; i < 6; ++i)
+		res.req[i] = q.op.buf[i], res.ans[i] = q.op.ans[i];
+	res.usec = q.op.done ? q.op.done - q.op.sent : 0;
+
+	rv_pump(r);
+
+	/* may close this device or any other */
+	if (q.cb)
+		q.cb(r, &res, q.arg);
+	return 1;
+}
+
+int rv_dispatch(void)
+{
+	jmp_buf jb, *old = fatal_jmp;
+	int i, m, n = 0;
+
+	if (rv_fd() < 0)
+		return -EIO;
+	if (setjmp(jb))
+	{
+		fatal_jmp = old;
+		return -EIO;
+	}
+	fatal_jmp = &jb;
+	ev_run(0);
+	fatal_jmp = old;
+
+	for (;;)
+	{
+		for (m = i = 0; i < MAX_DEVS; ++i)
+			if (rv_devs[i])
+				m += rv_reap(rv_devs[i]);
+		if (m == 0)
+			return n;
+		n += m;
+	}
+}
+
+#endif
+
 /* EOF */
@@ -0,0 +1,52 @@
+/*
+ * librevoco - talk to the receivers revoco knows without blocking.
+ *
+ * All devices share one fd, rv_fd().  Poll it for input and call
+ * rv_dispatch() when it is readable; requests complete in there and
+ * run their callback.  Up to 16 requests per device are in flight at
+ * once, more wait in its queue, all with the timeouts and retries
+ * revoco uses.  A hiddev receiver may lose an answer in such a burst,
+ * that request is sent again.
+ *
+ * Nothing exits or prints.  Calls return 0 (or a count) on success and
+ * -errno on failure, rv_error() has the details of the last one.
+ *
+ *	struct rv_dev *dev;
+ *	struct pollfd p = { rv_fd(), POLLIN };
+ *
+ *	if (rv_find(&dev, 1) == 1 && rv_query(dev, 0x0d, got_battery, NULL) == 0)
+ *		while (poll(&p, 1, -1) >= 0 && rv_dispatch() >= 0 && !done)
+ *			;
+ */
+#ifndef REVOCO_H
+#define REVOCO_H
+
+struct rv_dev;
+
+struct rv_result
+{
+	int status;			/* 0, -EPROTO if the device said no, -ETIMEDOUT, -EIO */
+	unsigned char req[6];		/* the HID++ request */
+	unsigned char ans[6];		/* its answer or the error frame `ix 8f sub reg err' */
+	long long usec;			/* from sending to the answer */
+};
+
+typedef void rv_callback(struct rv_dev *, const struct rv_result *, void *arg);
+
+int rv_fd(void);
+int rv_find(struct rv_dev **devs, int max);
+int rv_open(const char *path, struct rv_dev **dev);
+void rv_close(struct rv_dev *);		/* pending requests are dropped */
+const char *rv_path(const struct rv_dev *);
+int rv_index(const struct rv_dev *);	/* first byte of its HID++ frames */
+
+/* -EAGAIN when the device's queue is full */
+int rv_submit(struct rv_dev *, const unsigned char req[6], rv_callback *, void *arg);
+int rv_cmd(struct rv_dev *, int b1, int b2, int b3, rv_callback *, void *arg);
+int rv_query(struct rv_dev *, int reg, rv_callback *, void *arg);
+
+/* handles what is ready, never waits; returns the requests completed */
+int rv_dispatch(void);
+const char *rv_error(void);
+
+#endif